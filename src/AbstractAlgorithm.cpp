@@ -17,8 +17,139 @@
  *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <cmath>
+
+#include <QTime>
+
 #include "AbstractAlgorithm.h"
 
+AbstractAlgorithm::AbstractAlgorithm()
+	: m_continuous(false), m_speed(0), m_stepCount(0), m_sendSnapshot(NULL)
+{
+	connect(this, SIGNAL(finished()), this, SLOT(stepFinished()));
+}
+
+AbstractAlgorithm::~AbstractAlgorithm()
+{
+	clearSnapshots();
+}
+
+const Snapshot *AbstractAlgorithm::acquireSnapshot(int *slot) const
+{
+	*slot = m_epoch.enter();
+	return const_cast<QAtomicPointer<Snapshot> &>(m_snapshot).fetchAndAddOrdered(0);
+}
+
+void AbstractAlgorithm::releaseSnapshot(int slot) const
+{
+	if (slot >= 0)
+		m_epoch.leave(slot);
+}
+
+const Snapshot *AbstractAlgorithm::acquireSendSnapshot(int *slot) const
+{
+	if (m_sendSnapshot)
+	{
+		*slot = -1;
+		return m_sendSnapshot;
+	}
+	return acquireSnapshot(slot);
+}
+
+void AbstractAlgorithm::publishSnapshot(Snapshot *snapshot)
+{
+	Snapshot *old = m_snapshot.fetchAndStoreOrdered(snapshot);
+	// Readers which entered by the end of this epoch may have loaded old
+	if (old)
+		m_retired.append(qMakePair(m_epoch.advance(), old));
+	reclaimSnapshots(false);
+}
+
+void AbstractAlgorithm::reclaimSnapshots(bool wait)
+{
+	while (!m_retired.isEmpty())
+	{
+		if (m_epoch.isOver(m_retired.first().first))
+			delete m_retired.takeFirst().second;
+		else if (wait)
+			QThread::yieldCurrentThread();
+		else
+			break;
+	}
+}
+
+void AbstractAlgorithm::clearSnapshots()
+{
+	publishSnapshot(NULL);
+	reclaimSnapshots(true);
+}
+
+QList<Snapshot *> AbstractAlgorithm::liveSnapshots() const
+{
+	QList<Snapshot *> ret;
+	for (int i = 0; i < m_retired.size(); i++)
+		ret.append(m_retired[i].second);
+	if (m_snapshot)
+		ret.append(m_snapshot);
+	return ret;
+}
+
+void AbstractAlgorithm::runStep()
+{
+	if (isRunning())
+		return;
+	m_continuous = false;
+	start();
+}
+
+void AbstractAlgorithm::startRunning()
+{
+	m_continuous = true;
+	if (!isRunning())
+		start();
+}
+
+void AbstractAlgorithm::stopRunning()
+{
+	m_continuous = false;
+}
+
+void AbstractAlgorithm::setSpeed(int generationsPerSecond)
+{
+	m_speed = qMax(generationsPerSecond, 0);
+}
+
+// The thread may have been about to finish when startRunning() found it running
+void AbstractAlgorithm::stepFinished()
+{
+	if (m_continuous && !isRunning())
+		start();
+}
+
+// One thread runs the steps back to back, rather than one per step
+void AbstractAlgorithm::run()
+{
+	QTime timer;
+	do
+	{
+		timer.start();
+		step();
+		m_stepCount.ref();
+		int speed = m_speed;
+		if (!speed)
+			continue;
+		// Each step is given the share of a second of the generations it advanced
+		double pause = ldexp(1000.0 / speed, static_cast<int>(stepExponent())) - timer.elapsed();
+		while (m_continuous && pause > 0)
+		{
+			int msecs = qBound(1, static_cast<int>(pause), MAX_PAUSE);
+			msleep(msecs);
+			pause -= msecs;
+		}
+	} while (m_continuous);
+	emit gridChanged();
+}
+
 void AbstractAlgorithm::getRect(BigInteger *x, BigInteger *y, BigInteger *w, BigInteger *h)
 {
 	*x = m_x;
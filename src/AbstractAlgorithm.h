@@ -20,22 +20,52 @@
 #ifndef ABSTRACTALGORITHM_H
 #define ABSTRACTALGORITHM_H
 
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QList>
+#include <QPair>
 #include <QThread>
 
 #include "BigInteger.h"
 #include "DataChannel.h"
+#include "Epoch.h"
+
+/// A generation of the universe, see AbstractAlgorithm::acquireSnapshot()
+// The root covers 2^depth x 2^depth cells from (x, y), emptyNode is the empty node of the same depth.
+// Both are nodes of the algorithm's own type.
+struct Snapshot
+{
+	Snapshot(): root(NULL), emptyNode(NULL), depth(0) {}
+	virtual ~Snapshot() {}
+
+	void *root, *emptyNode;
+	size_t depth;
+	BigInteger x, y;
+	BigInteger generation;
+};
 
 class CanvasPainter;
 class Rule;
-class AbstractAlgorithm: public QThread, public DataReceiver
+class AbstractAlgorithm: public QThread, public DataReceiver, public DataSender
 {
 	Q_OBJECT
 
 public:
-	virtual ~AbstractAlgorithm() {}
+	AbstractAlgorithm();
+	virtual ~AbstractAlgorithm();
+
+	/// The last generation published, neither changed nor freed until releaseSnapshot(slot)
+	// Readers take no lock, so they never wait for a step.
+	const Snapshot *acquireSnapshot(int *slot) const;
+	/// Does nothing for a negative slot
+	void releaseSnapshot(int slot) const;
+	/// Has boundingRect() and send() read snapshot, acquired by the caller, rather than the last generation; NULL to undo
+	void setSendSnapshot(const Snapshot *snapshot) { m_sendSnapshot = snapshot; }
 
 	virtual QString name() = 0;
 	virtual bool acceptRule(Rule *rule) = 0;
+	/// Called by AlgorithmManager whenever a new rule is in use
+	virtual void setRule(Rule *rule) { Q_UNUSED(rule); }
 
 	virtual int grid(const BigInteger &x, const BigInteger &y) = 0;
 	virtual void setGrid(const BigInteger &x, const BigInteger &y, int state) = 0;
@@ -45,7 +75,26 @@ public:
 	virtual void getRect(BigInteger *x, BigInteger *y, BigInteger *w, BigInteger *h);
 	virtual void setRect(const BigInteger &x, const BigInteger &y, const BigInteger &w, const BigInteger &h);
 	virtual void paint(CanvasPainter *painter, const BigInteger &x, const BigInteger &y, int w, int h, size_t scale) = 0;
-	virtual void runStep() = 0;
+	/// Runs a single step on the algorithm thread, unless a step is running
+	virtual void runStep();
+	/// Keeps stepping on the algorithm thread until stopRunning()
+	// No gridChanged() is emitted meanwhile, stepCount() tells of the steps instead.
+	void startRunning();
+	void stopRunning();
+	bool isContinuous() const { return m_continuous; }
+	/// Generations per second when continuous, 0 for as fast as possible
+	int speed() const { return m_speed; }
+	void setSpeed(int generationsPerSecond);
+	/// Steps completed so far
+	int stepCount() const { return m_stepCount; }
+	/// Abandons the step running if the algorithm can, the universe is left as before it
+	virtual void cancelStep() {}
+	virtual size_t stepExponent() const { return 0; }
+	virtual void setStepExponent(size_t exponent) { Q_UNUSED(exponent); }
+	virtual bool isHyperspeed() const { return false; }
+	virtual void setHyperspeed(bool hyperspeed) { Q_UNUSED(hyperspeed); }
+	virtual int threadCount() const { return 1; }
+	virtual void setThreadCount(int count) { Q_UNUSED(count); }
 
 	virtual bool acceptInfinity() { return m_acceptInfinity; }
 	virtual bool isVerticalInfinity() { return m_vertInfinity; }
@@ -58,13 +107,49 @@ public:
 signals:
 	void rectChanged();
 	void gridChanged();
+	/// Nodes computed so far by a long step, and an estimate of the part of it done
+	void stepProgress(qulonglong nodes, double fraction);
 
 protected:
+	/// Advances the universe by 2^stepExponent() generations on the algorithm thread
+	virtual void step() = 0;
 	virtual void rectChange(const BigInteger &x, const BigInteger &y, const BigInteger &w, const BigInteger &h) = 0;
 	virtual void infinityChange() {}
 	virtual void setAcceptInfinity(bool acceptInfinity);
 
+	// Only the writer, holding the lock of the algorithm, may call these
+	/// Makes snapshot the one acquired, the previous one is deleted once no reader has it
+	void publishSnapshot(Snapshot *snapshot);
+	/// The one last published
+	Snapshot *snapshot() const { return m_snapshot; }
+	/// Deletes the retired snapshots no reader has any more, waiting for the readers of all of them if wait
+	void reclaimSnapshots(bool wait);
+	/// Waits for the readers and deletes every snapshot, the last one included
+	// Left to the destructor of subclasses whose snapshots use them when deleted.
+	void clearSnapshots();
+	/// The snapshots published and not deleted yet, the last one included
+	QList<Snapshot *> liveSnapshots() const;
+	/// The send snapshot with slot set to -1 if there is one, otherwise acquireSnapshot()
+	const Snapshot *acquireSendSnapshot(int *slot) const;
+
+private slots:
+	void stepFinished();
+
 private:
+	// Pauses between continuous steps are cut so stopRunning() takes effect soon
+	static const int MAX_PAUSE = 50;
+
+	virtual void run();
+
+	volatile bool m_continuous;
+	volatile int m_speed;
+	QAtomicInt m_stepCount;
+	mutable Epoch m_epoch;
+	QAtomicPointer<Snapshot> m_snapshot;
+	// Oldest first, along with the epoch they were retired in
+	QList<QPair<int, Snapshot *> > m_retired;
+	const Snapshot *m_sendSnapshot;
+
 	BigInteger m_x, m_y, m_w, m_h;
 	bool m_acceptInfinity;
 	bool m_vertInfinity, m_horiInfinity;
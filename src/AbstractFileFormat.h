@@ -30,7 +30,11 @@ public:
 	virtual ~AbstractFileFormat() {}
 	virtual QString formatName() const = 0;
 	virtual QList<QString> supportedFormats() const = 0;
+	/// Whether the cells of algorithm can be read and written in this format
+	virtual bool acceptAlgorithm(AbstractAlgorithm *algorithm) const { Q_UNUSED(algorithm); return true; }
 	virtual bool readDevice(QIODevice *device, AbstractAlgorithm *algorithm) = 0;
+	/// Formats which can only be read return false
+	virtual bool writeDevice(QIODevice *device, AbstractAlgorithm *algorithm) { Q_UNUSED(device); Q_UNUSED(algorithm); return false; }
 };
 
 #endif
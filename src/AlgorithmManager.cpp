@@ -17,6 +17,8 @@
  *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <QTimer>
+
 #include "AbstractAlgorithm.h"
 #include "AlgorithmManager.h"
 #include "Rule.h"
@@ -27,6 +29,11 @@ AlgorithmManager::AlgorithmManager()
 {
 	m_rule = NULL;
 	m_algorithm = NULL;
+	m_speed = 0;
+	m_stepCount = 0;
+	m_frameTimer = new QTimer(this);
+	m_frameTimer->setInterval(FRAME_INTERVAL);
+	connect(m_frameTimer, SIGNAL(timeout()), this, SLOT(frame()));
 }
 
 AlgorithmManager *AlgorithmManager::self()
@@ -39,39 +46,111 @@ void AlgorithmManager::setRule(Rule *rule)
 	if (self()->m_rule)
 		delete self()->m_rule;
 	self()->m_rule = rule;
-	if (self()->m_algorithm && !self()->m_algorithm->acceptRule(rule))
-	{
-		delete self()->m_algorithm;
-		self()->m_algorithm = NULL;
-	}
-	if (!self()->m_algorithm)
+	if (!self()->m_algorithm || !self()->m_algorithm->acceptRule(rule))
 	{
+		AbstractAlgorithm *algorithm = NULL;
 		foreach (AbstractAlgorithmFactory *factory, self()->m_factory)
 		{
 			// TODO: Optimization
-			AbstractAlgorithm *algorithm = factory->createAlgorithm();
+			algorithm = factory->createAlgorithm();
 			if (algorithm->acceptRule(rule))
-			{
-				connect(algorithm, SIGNAL(rectChanged()), self(), SIGNAL(rectChanged()));
-				connect(algorithm, SIGNAL(gridChanged()), self(), SIGNAL(gridChanged()));
-				self()->m_algorithm = algorithm;
 				break;
-			}
 			delete algorithm;
+			algorithm = NULL;
 		}
-		if (!self()->m_algorithm)
+		if (!algorithm)
 			qFatal("No algorithm supports rule %s.", qPrintable(rule->string()));
-		emit self()->algorithmChanged();
+		setAlgorithm(algorithm);
 	}
+	else
+		self()->m_algorithm->setRule(rule);
 	emit self()->ruleChanged();
 }
 
+void AlgorithmManager::setAlgorithm(AbstractAlgorithm *algorithm)
+{
+	AbstractAlgorithm *oldAlgorithm = self()->m_algorithm;
+	if (oldAlgorithm)
+	{
+		self()->stopRunning();
+		oldAlgorithm->wait();
+	}
+	connect(algorithm, SIGNAL(rectChanged()), self(), SIGNAL(rectChanged()));
+	connect(algorithm, SIGNAL(gridChanged()), self(), SIGNAL(gridChanged()));
+	connect(algorithm, SIGNAL(stepProgress(qulonglong, double)), self(), SIGNAL(stepProgress(qulonglong, double)));
+	algorithm->setSpeed(self()->m_speed);
+	if (self()->m_rule)
+		algorithm->setRule(self()->m_rule);
+	// The render thread may still be painting the old one
+	self()->m_algorithmLock.lockForWrite();
+	self()->m_algorithm = algorithm;
+	self()->m_algorithmLock.unlock();
+	delete oldAlgorithm;
+	self()->m_stepCount = 0;
+	emit self()->algorithmChanged();
+}
+
 void AlgorithmManager::registerAlgorithm(AbstractAlgorithmFactory *algorithmFactory)
 {
 	self()->m_factory.append(algorithmFactory);
 }
 
+bool AlgorithmManager::isRunning()
+{
+	return self()->m_frameTimer->isActive();
+}
+
+void AlgorithmManager::setSpeed(int generationsPerSecond)
+{
+	self()->m_speed = generationsPerSecond;
+	if (algorithm())
+		algorithm()->setSpeed(generationsPerSecond);
+}
+
 void AlgorithmManager::runStep()
 {
-	algorithm()->runStep();
+	if (!isRunning())
+		algorithm()->runStep();
+}
+
+void AlgorithmManager::startRunning()
+{
+	m_stepCount = algorithm()->stepCount();
+	algorithm()->startRunning();
+	m_frameTimer->start();
+}
+
+void AlgorithmManager::stopRunning()
+{
+	if (m_algorithm)
+		m_algorithm->stopRunning();
+}
+
+void AlgorithmManager::toggleRunning()
+{
+	if (algorithm()->isContinuous())
+		stopRunning();
+	else
+		startRunning();
+}
+
+void AlgorithmManager::cancelStep()
+{
+	stopRunning();
+	algorithm()->cancelStep();
+}
+
+// The algorithm emits no gridChanged() while running, so the steps done are
+// looked for once a frame instead of repainting after every one of them
+void AlgorithmManager::frame()
+{
+	int stepCount = m_algorithm->stepCount();
+	if (stepCount != m_stepCount)
+	{
+		m_stepCount = stepCount;
+		emit gridChanged();
+	}
+	// The last step emits gridChanged() itself
+	if (!m_algorithm->isContinuous())
+		m_frameTimer->stop();
 }
@@ -21,9 +21,11 @@
 #define ALGORITHMMANAGER_H
 
 #include <QObject>
+#include <QReadWriteLock>
 
 #include "Utils.h"
 
+class QTimer;
 class AbstractAlgorithm;
 class Rule;
 class AlgorithmManager: public QObject
@@ -39,20 +41,47 @@ public:
 	static Rule *rule() { return self()->m_rule; }
 	static void setRule(Rule *rule);
 	static AbstractAlgorithm *algorithm() { return self()->m_algorithm; }
+	/// Replaces the algorithm in use, which must accept the rule in use if any
+	static void setAlgorithm(AbstractAlgorithm *algorithm);
+	/// Keeps the algorithm in use from being replaced until unlockAlgorithm(), for threads other than the GUI one
+	static void lockAlgorithm() { self()->m_algorithmLock.lockForRead(); }
+	static void unlockAlgorithm() { self()->m_algorithmLock.unlock(); }
 	static void registerAlgorithm(AbstractAlgorithmFactory *algorithmFactory);
+	static bool isRunning();
+	static int speed() { return self()->m_speed; }
+	/// Generations per second when running, 0 for as fast as possible
+	static void setSpeed(int generationsPerSecond);
 
 public slots:
 	void runStep();
+	/// Keeps the algorithm stepping, gridChanged() is emitted once per frame at most meanwhile
+	void startRunning();
+	void stopRunning();
+	void toggleRunning();
+	/// Stops running, abandoning the step in progress if possible
+	void cancelStep();
 
 signals:
 	void ruleChanged();
 	void algorithmChanged();
 	void rectChanged();
 	void gridChanged();
+	void stepProgress(qulonglong nodes, double fraction);
+
+private slots:
+	void frame();
 
 private:
+	// About 60 frames per second
+	static const int FRAME_INTERVAL = 16;
+
 	AbstractAlgorithm *m_algorithm;
+	QReadWriteLock m_algorithmLock;
 	Rule *m_rule;
+	int m_speed;
+	QTimer *m_frameTimer;
+	// Of the algorithm, when gridChanged() was last emitted for its steps
+	int m_stepCount;
 
 	QList<AbstractAlgorithmFactory *> m_factory;
 };
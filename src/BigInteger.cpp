@@ -17,383 +17,537 @@
  *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <cstring>
+
 #include <QString>
 
 #include "BigInteger.h"
-#include "Config.h"
 
 BigInteger::BigInteger()
+	: m_size(1), m_capacity(INLINE_LIMBS)
 {
-//	mpz_init(data);
+	m_inline[0] = 0;
 }
 
-// we believe sizeof(long int) >= sizeof(qint32)
 BigInteger::BigInteger(qint32 num)
+	: m_size(1), m_capacity(INLINE_LIMBS)
 {
-//	mpz_init_set_si(data, (signed long int) num);
+	setSigned(num);
 }
 
 BigInteger::BigInteger(quint32 num)
+	: m_size(1), m_capacity(INLINE_LIMBS)
 {
-//	mpz_init_set_ui(data, (unsigned long int) num);
+	setUnsigned(num);
 }
 
 BigInteger::BigInteger(qint64 num)
+	: m_size(1), m_capacity(INLINE_LIMBS)
 {
-/*#if SIZEOF_SIGNED_LONG == 8
-	mpz_init_set_si(data, static_cast<signed long int>(num));
-#elif SIZEOF_SIGNED_LONG == 4
-	mpz_init_set_si(data, static_cast<signed long int>(num >> 32));
-	mpz_mul_2exp(data, data, 32);
-	mpz_add_ui(data, data, static_cast<signed long int>(num));
-#else
-#error "SIZEOF_SIGNED_LONG is a unhandled case"
-#endif*/
+	setSigned(num);
 }
 
 BigInteger::BigInteger(quint64 num)
+	: m_size(1), m_capacity(INLINE_LIMBS)
 {
-/*#if SIZEOF_UNSIGNED_LONG == 8
-	mpz_init_set_ui(data, static_cast<unsigned long int>(num));
-#elif SIZEOF_UNSIGNED_LONG == 4
-	mpz_init_set_ui(data, static_cast<unsigned long int>(num >> 32));
-	mpz_mul_2exp(data, data, 32);
-	mpz_add_ui(data, data, static_cast<unsigned long int>(num));
-#else
-#error "SIZEOF_UNSIGNED_LONG is a unhandled case"
-#endif*/
+	setUnsigned(num);
 }
 
 BigInteger::BigInteger(const BigInteger &num)
+	: m_size(1), m_capacity(INLINE_LIMBS)
+{
+	*this = num;
+}
+
+BigInteger::BigInteger(BigInteger &&num)
+	: m_size(num.m_size), m_capacity(num.m_capacity)
 {
-//	mpz_init_set(data, num.data);
+	memcpy(m_inline, num.m_inline, sizeof m_inline);
+	num.m_size = 1;
+	num.m_capacity = INLINE_LIMBS;
+	num.m_inline[0] = 0;
 }
 
 BigInteger::BigInteger(const QString &num)
+	: m_size(1), m_capacity(INLINE_LIMBS)
 {
-//	mpz_init_set_str(data, num.toAscii(), 10);
+	m_inline[0] = 0;
+	bool minus = num.startsWith('-');
+	for (int i = minus? 1: 0; i < num.length(); i++)
+	{
+		*this = *this * 10;
+		*this += num.at(i).toAscii() - '0';
+	}
+	if (minus)
+		negate();
 }
 
 BigInteger::~BigInteger()
 {
-//	mpz_clear(data);
+	if (m_capacity > INLINE_LIMBS)
+		delete[] m_heap;
 }
 
-// Same as above
 BigInteger& BigInteger::operator = (qint32 num)
 {
-//	mpz_set_si(data, (signed long int) num);
-    return *this;
+	setSigned(num);
+	return *this;
 }
 
 BigInteger& BigInteger::operator = (quint32 num)
 {
-//	mpz_set_si(data, (unsigned long int) num);
-    return *this;
+	setUnsigned(num);
+	return *this;
 }
 
 BigInteger& BigInteger::operator = (qint64 num)
 {
-/*#if SIZEOF_SIGNED_LONG == 8
-	mpz_set_si(data, static_cast<signed long int>(num));
-#elif SIZEOF_SIGNED_LONG == 4
-	mpz_set_si(data, static_cast<signed long int>(num >> 32));
-	mpz_mul_2exp(data, data, 32);
-	mpz_add_ui(data, data, static_cast<signed long int>(num));
-#else
-#error "SIZEOF_SIGNED_LONG is a unhandled case"
-#endif*/
+	setSigned(num);
 	return *this;
 }
 
 BigInteger& BigInteger::operator = (quint64 num)
 {
-/*#if SIZEOF_UNSIGNED_LONG == 8
-	mpz_set_ui(data, static_cast<unsigned long int>(num));
-#elif SIZEOF_UNSIGNED_LONG == 4
-	mpz_set_ui(data, static_cast<unsigned long int>(num >> 32));
-	mpz_mul_2exp(data, data, 32);
-	mpz_add_ui(data, data, static_cast<unsigned long int>(num));
-#else
-#error "SIZEOF_UNSIGNED_LONG is a unhandled case"
-#endif*/
+	setUnsigned(num);
 	return *this;
 }
 
 BigInteger& BigInteger::operator = (const BigInteger &num)
 {
-//	mpz_set(data, num.data);
+	if (this != &num)
+	{
+		resize(num.m_size);
+		memcpy(limbs(), num.limbs(), num.m_size * sizeof(quint64));
+	}
+	return *this;
+}
+
+BigInteger& BigInteger::operator = (BigInteger &&num)
+{
+	if (this != &num)
+	{
+		if (m_capacity > INLINE_LIMBS)
+			delete[] m_heap;
+		m_size = num.m_size;
+		m_capacity = num.m_capacity;
+		memcpy(m_inline, num.m_inline, sizeof m_inline);
+		num.m_size = 1;
+		num.m_capacity = INLINE_LIMBS;
+		num.m_inline[0] = 0;
+	}
 	return *this;
 }
 
 BigInteger::operator int() const
 {
-//	return mpz_get_si(data);
-    return 0;
+	return static_cast<int>(limbs()[0]);
 }
 
 BigInteger::operator QString() const
 {
-//	char *num = mpz_get_str(NULL, 10, data);
-//	QString ret(num);
-//	delete num;
-//	return ret;
-    return QString();
+	if (sgn() == 0)
+		return "0";
+	// Split the absolute value into base 10^9 digits, least significant first
+	BigInteger num(*this);
+	if (negative())
+		num.negate();
+	QString ret;
+	while (num.sgn() > 0)
+	{
+		quint64 rem = 0;
+		for (int i = num.m_size - 1; i >= 0; i--)
+		{
+			quint64 high = (rem << 32) | (num.limbs()[i] >> 32);
+			quint64 low = ((high % 1000000000) << 32) | (num.limbs()[i] & 0xFFFFFFFF);
+			num.limbs()[i] = ((high / 1000000000) << 32) | (low / 1000000000);
+			rem = low % 1000000000;
+		}
+		num.normalize();
+		QString digits = QString::number(rem);
+		if (num.sgn() > 0)
+			digits = digits.rightJustified(9, '0');
+		ret.prepend(digits);
+	}
+	if (negative())
+		ret.prepend('-');
+	return ret;
 }
 
 BigInteger BigInteger::exp2(int exp)
 {
-//	BigInteger ret;
-//	ret.setBit(exp);
-//	return ret;
-    return BigInteger();
+	BigInteger ret;
+	ret.setBit(exp);
+	return ret;
 }
 
 int BigInteger::sgn() const
 {
-//	return mpz_sgn(data);
-    return 0;
+	if (negative())
+		return -1;
+	return m_size > 1 || limbs()[0]? 1: 0;
 }
 
 size_t BigInteger::bitCount() const
 {
-//	return mpz_sizeinbase(data, 2);
-    return 0;
+	BigInteger num(*this);
+	if (num.negative())
+		num.negate();
+	quint64 top = num.limbs()[num.m_size - 1];
+	size_t ret = (num.m_size - 1) * LIMB_BITS;
+	for (; top; top >>= 1)
+		ret++;
+	return qMax(ret, static_cast<size_t>(1));
 }
 
 int BigInteger::bit(size_t id) const
 {
-//	return mpz_tstbit(data, (mp_bitcnt_t) id);
-    return 0;
+	return (limb(id / LIMB_BITS) >> (id % LIMB_BITS)) & 1;
 }
 
 void BigInteger::setBit(size_t id)
 {
-//	mpz_setbit(data, (mp_bitcnt_t) id);
+	// One more limb keeps the sign
+	if (id / LIMB_BITS + 1 >= static_cast<size_t>(m_size))
+		resize(id / LIMB_BITS + 2);
+	limbs()[id / LIMB_BITS] |= static_cast<quint64>(1) << (id % LIMB_BITS);
+	normalize();
 }
 
 BigInteger BigInteger::operator + (const BigInteger &num) const
 {
-//	BigInteger ret;
-//	mpz_add(ret.data, data, num.data);
-//	return ret;
-    return BigInteger();
+	BigInteger ret(*this);
+	ret.add(num, false);
+	return ret;
 }
 
 BigInteger BigInteger::operator + (int num) const
 {
-//	BigInteger ret;
-//	if (num > 0)
-//		mpz_add_ui(ret.data, data, (unsigned long int) num);
-//	else
-//		mpz_sub_ui(ret.data, data, (unsigned long int) -num);
-//	return ret;
-    return BigInteger();
+	BigInteger ret(*this);
+	ret += num;
+	return ret;
 }
 
 BigInteger BigInteger::operator + (uint num) const
 {
-    return BigInteger();
+	return *this + BigInteger(static_cast<quint32>(num));
 }
 
 BigInteger BigInteger::operator + (ulong num) const
 {
-//	BigInteger ret;
-//	mpz_add_ui(ret.data, data, num);
-//	return ret;
-    return BigInteger();
+	return *this + BigInteger(static_cast<quint64>(num));
 }
 
 BigInteger& BigInteger::operator += (const BigInteger &num)
 {
-//	mpz_add(data, data, num.data);
-    return *this;
-}
-
-BigInteger& BigInteger::operator += (int num)
-{
-//	if (num > 0)
-//		mpz_add_ui(data, data, (unsigned long int) num);
-//	else
-//		mpz_sub_ui(data, data, (unsigned long int) -num);
-    return *this;
+	add(num, false);
+	return *this;
 }
 
 BigInteger BigInteger::operator - (const BigInteger &num) const
 {
-//	BigInteger ret;
-//	mpz_sub(ret.data, data, num.data);
-//	return ret;
-    return BigInteger();
+	BigInteger ret(*this);
+	ret.add(num, true);
+	return ret;
 }
 
 BigInteger BigInteger::operator - (int num) const
 {
-//	BigInteger ret;
-//	if (num > 0)
-//		mpz_sub_ui(ret.data, data, (unsigned long int) num);
-//	else
-//		mpz_add_ui(ret.data, data, (unsigned long int) -num);
-//	return ret;
-    return BigInteger();
+	BigInteger ret(*this);
+	ret -= num;
+	return ret;
 }
 
 BigInteger BigInteger::operator - (uint num) const
 {
-    return BigInteger();
+	return *this - BigInteger(static_cast<quint32>(num));
 }
 
 BigInteger BigInteger::operator - (ulong num) const
 {
-//	BigInteger ret;
-//	mpz_sub_ui(ret.data, data, num);
-//	return ret;
-    return BigInteger();
+	return *this - BigInteger(static_cast<quint64>(num));
 }
 
 BigInteger& BigInteger::operator -= (const BigInteger &num)
 {
-//	mpz_sub(data, data, num.data);
-    return *this;
+	add(num, true);
+	return *this;
 }
 
 BigInteger& BigInteger::operator -= (int num)
 {
-//	if (num > 0)
-//		mpz_sub_ui(data, data, (unsigned long int) num);
-//	else
-//		mpz_add_ui(data, data, (unsigned long int) -num);
-    return *this;
+	if (num == -num) // INT_MIN or 0
+		return *this -= BigInteger(num);
+	return *this += -num;
 }
 
 BigInteger BigInteger::operator * (int num) const
 {
-//	BigInteger ret;
-//	mpz_mul_si(ret.data, data, (long int) num);
-//	return ret;
-    return BigInteger();
+	BigInteger ret(*this);
+	bool minus = ret.negative() != (num < 0);
+	if (ret.negative())
+		ret.negate();
+	quint64 factor = num < 0? -static_cast<qint64>(num): num;
+	ret.resize(ret.m_size + 1);
+	// factor < 2^32, so each half limb product fits
+	quint64 carry = 0;
+	for (int i = 0; i < ret.m_size; i++)
+	{
+		quint64 low = (ret.limbs()[i] & 0xFFFFFFFF) * factor + carry;
+		quint64 high = (ret.limbs()[i] >> 32) * factor + (low >> 32);
+		ret.limbs()[i] = (high << 32) | (low & 0xFFFFFFFF);
+		carry = high >> 32;
+	}
+	ret.normalize();
+	if (minus)
+		ret.negate();
+	return ret;
 }
 
 BigInteger BigInteger::operator / (int num) const
 {
-//	BigInteger ret;
-//	if (num > 0)
-//		mpz_div_ui(ret.data, data, (unsigned long int) num);
-//	else
-//	{
-//		mpz_div_ui(ret.data, data, (unsigned long int) -num);
-//		mpz_neg(ret.data, ret.data);
-//	}
-//  return ret;
-    return BigInteger();
+	BigInteger ret(*this);
+	bool minus = ret.negative();
+	if (minus)
+		ret.negate();
+	quint64 divisor = num < 0? -static_cast<qint64>(num): num;
+	quint64 rem = 0;
+	for (int i = ret.m_size - 1; i >= 0; i--)
+	{
+		quint64 high = (rem << 32) | (ret.limbs()[i] >> 32);
+		quint64 low = ((high % divisor) << 32) | (ret.limbs()[i] & 0xFFFFFFFF);
+		ret.limbs()[i] = ((high / divisor) << 32) | (low / divisor);
+		rem = low % divisor;
+	}
+	ret.normalize();
+	if (minus)
+	{
+		ret.negate();
+		if (rem)
+			ret += -1;
+	}
+	if (num < 0)
+		ret.negate();
+	return ret;
 }
 
 BigInteger BigInteger::operator << (int num) const
 {
-    return BigInteger();
+	return num < 0? *this >> static_cast<uint>(-num): *this << static_cast<uint>(num);
 }
 
 BigInteger BigInteger::operator << (uint num) const
 {
-//	BigInteger ret;
-//	mpz_mul_2exp(ret.data, data, num);
-//  return ret;
-    return BigInteger();
+	BigInteger ret(*this);
+	ret.shiftLeft(num);
+	return ret;
 }
 
 BigInteger& BigInteger::operator <<= (uint num)
 {
-//	mpz_mul_2exp(data, data, num);
+	shiftLeft(num);
 	return *this;
 }
 
 BigInteger BigInteger::operator >> (int num) const
 {
-    return BigInteger();
+	return num < 0? *this << static_cast<uint>(-num): *this >> static_cast<uint>(num);
 }
 
 BigInteger BigInteger::operator >> (uint num) const
 {
-//	BigInteger ret;
-//	mpz_div_2exp(ret.data, data, num);
-//	return ret;
-    return BigInteger();
+	BigInteger ret(*this);
+	ret.shiftRight(num);
+	return ret;
 }
 
 BigInteger& BigInteger::operator >>= (uint num)
 {
-//	mpz_div_2exp(data, data, num);
-    return *this;
+	shiftRight(num);
+	return *this;
 }
 
 bool BigInteger::operator == (const BigInteger &num) const
 {
-//	return mpz_cmp(data, num.data) == 0;
-    return 0;
+	return compare(num) == 0;
 }
 
 bool BigInteger::operator == (int num) const
 {
-//	return mpz_cmp_si(data, num) == 0;
-    return 0;
+	return m_size == 1 && static_cast<qint64>(limbs()[0]) == num;
 }
 
 bool BigInteger::operator != (const BigInteger &num) const
 {
-//	return mpz_cmp(data, num.data) != 0;
-    return 0;
+	return compare(num) != 0;
 }
 
 bool BigInteger::operator != (int num) const
 {
-//	return mpz_cmp_si(data, num) != 0;
-    return 0;
+	return !(*this == num);
 }
 
 bool BigInteger::operator < (const BigInteger &num) const
 {
-//	return mpz_cmp(data, num.data) < 0;
-    return 0;
+	return compare(num) < 0;
 }
 
 bool BigInteger::operator < (int num) const
 {
-//	return mpz_cmp_si(data, num) < 0;
-    return 0;
+	return compare(BigInteger(num)) < 0;
 }
 
 bool BigInteger::operator <= (const BigInteger &num) const
 {
-//	return mpz_cmp(data, num.data) <= 0;
-    return 0;
+	return compare(num) <= 0;
 }
 
 bool BigInteger::operator <= (int num) const
 {
-//	return mpz_cmp_si(data, num) <= 0;
-    return 0;
+	return compare(BigInteger(num)) <= 0;
 }
 
 bool BigInteger::operator > (const BigInteger &num) const
 {
-//	return mpz_cmp(data, num.data) > 0;
-    return 0;
+	return compare(num) > 0;
 }
 
 bool BigInteger::operator > (int num) const
 {
-//	return mpz_cmp_si(data, num) > 0;
-    return 0;
+	return compare(BigInteger(num)) > 0;
 }
 
 bool BigInteger::operator >= (const BigInteger &num) const
 {
-//	return mpz_cmp(data, num.data) >= 0;
-    return 0;
+	return compare(num) >= 0;
 }
 
 bool BigInteger::operator >= (int num) const
 {
-//	return mpz_cmp_si(data, num) >= 0;
-    return 0;
+	return compare(BigInteger(num)) >= 0;
+}
+
+void BigInteger::setSigned(qint64 num)
+{
+	m_size = 1;
+	limbs()[0] = static_cast<quint64>(num);
+}
+
+void BigInteger::setUnsigned(quint64 num)
+{
+	m_size = 1;
+	limbs()[0] = num;
+	// The top bit would read as the sign
+	if (num >> (LIMB_BITS - 1))
+	{
+		resize(2);
+		limbs()[1] = 0;
+	}
+}
+
+// Sign extends to size limbs
+void BigInteger::resize(int size)
+{
+	if (size > m_capacity)
+	{
+		int capacity = qMax(size, m_capacity * 2);
+		quint64 *heap = new quint64[capacity];
+		memcpy(heap, limbs(), m_size * sizeof(quint64));
+		if (m_capacity > INLINE_LIMBS)
+			delete[] m_heap;
+		m_heap = heap;
+		m_capacity = capacity;
+	}
+	quint64 extension = negative()? ~static_cast<quint64>(0): 0;
+	for (int i = m_size; i < size; i++)
+		limbs()[i] = extension;
+	m_size = size;
+}
+
+// Drops the limbs that only repeat the sign
+void BigInteger::normalize()
+{
+	quint64 *p = limbs();
+	while (m_size > 1 && p[m_size - 1] == ((p[m_size - 2] >> (LIMB_BITS - 1))? ~static_cast<quint64>(0): 0))
+		m_size--;
+}
+
+void BigInteger::add(const BigInteger &num, bool subtract)
+{
+	int size = qMax(m_size, num.m_size) + 1;
+	// num may be *this, so take what is needed of it before resizing
+	int numSize = num.m_size;
+	quint64 numExtension = num.negative()? ~static_cast<quint64>(0): 0;
+	resize(size);
+	const quint64 *numLimbs = num.limbs();
+	quint64 carry = subtract? 1: 0;
+	for (int i = 0; i < size; i++)
+	{
+		quint64 b = i < numSize? numLimbs[i]: numExtension;
+		if (subtract)
+			b = ~b;
+		quint64 a = limbs()[i];
+		quint64 r = a + b;
+		quint64 c = r < a;
+		r += carry;
+		c |= r < carry;
+		limbs()[i] = r;
+		carry = c;
+	}
+	normalize();
+}
+
+void BigInteger::shiftLeft(size_t count)
+{
+	size_t limbShift = count / LIMB_BITS, bitShift = count % LIMB_BITS;
+	resize(m_size + limbShift + 1);
+	// From the top down, so every limb is read before it is overwritten
+	quint64 *p = limbs();
+	for (int i = m_size - 1; i >= 0; i--)
+	{
+		int from = i - static_cast<int>(limbShift);
+		quint64 high = from >= 0? p[from]: 0;
+		quint64 low = from >= 1? p[from - 1]: 0;
+		p[i] = bitShift? (high << bitShift) | (low >> (LIMB_BITS - bitShift)): high;
+	}
+	normalize();
+}
+
+void BigInteger::shiftRight(size_t count)
+{
+	size_t limbShift = count / LIMB_BITS, bitShift = count % LIMB_BITS;
+	if (limbShift >= static_cast<size_t>(m_size))
+	{
+		setSigned(negative()? -1: 0);
+		return;
+	}
+	quint64 *p = limbs();
+	for (size_t i = 0; i + limbShift < static_cast<size_t>(m_size); i++)
+	{
+		quint64 low = p[i + limbShift];
+		quint64 high = limb(i + limbShift + 1);
+		p[i] = bitShift? (low >> bitShift) | (high << (LIMB_BITS - bitShift)): low;
+	}
+	m_size -= limbShift;
+	normalize();
+}
+
+void BigInteger::negate()
+{
+	BigInteger zero;
+	zero.add(*this, true);
+	*this = static_cast<BigInteger &&>(zero);
+}
+
+int BigInteger::compare(const BigInteger &num) const
+{
+	if (negative() != num.negative())
+		return negative()? -1: 1;
+	// Same sign, so the two's complement limbs order as unsigned numbers
+	for (int i = qMax(m_size, num.m_size) - 1; i >= 0; i--)
+	{
+		quint64 a = limb(i), b = num.limb(i);
+		if (a != b)
+			return a < b? -1: 1;
+	}
+	return 0;
 }
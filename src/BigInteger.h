@@ -24,6 +24,10 @@
 
 class QDebug;
 class QString;
+/// Arbitrary precision integer
+// Stored in two's complement as 64-bit limbs, least significant first, the
+// last limb extending to the sign. Values of up to 128 bits are kept inline
+// and never allocate.
 class BigInteger
 {
 public:
@@ -33,6 +37,7 @@ public:
 	BigInteger(qint64 num);
 	BigInteger(quint64 num);
 	BigInteger(const BigInteger &num);
+	BigInteger(BigInteger &&num);
 	BigInteger(const QString &num);
 	~BigInteger();
 
@@ -41,54 +46,68 @@ public:
 	BigInteger& operator = (qint64 num);
 	BigInteger& operator = (quint64 num);
 	BigInteger& operator = (const BigInteger &num);
+	BigInteger& operator = (BigInteger &&num);
 
 	operator int() const;
 	operator QString() const;
 
 	static BigInteger exp2(int exp);
 	int sgn() const;
+	/// Number of bits of the absolute value, 1 for 0
 	size_t bitCount() const;
+	/// Bit of the two's complement representation
 	int bit(size_t id) const;
 	void setBit(size_t id);
+	/// The lowest count (at most 64) bits of the two's complement representation
 	template <typename T>
 	inline T lowbits(size_t count) const
 	{
-/*		T ret = 0;
-		int c = 0, n = 0;
-		while (count > GMP_LIMB_BITS)
-		{
-			ret |= mpz_getlimbn(data, n++) << c;
-			count -= GMP_LIMB_BITS;
-			c += GMP_LIMB_BITS;
-		}
-        return ret | ((mpz_getlimbn(data, n) & ((1 << count) - 1)) << c);*/
-        return 0;
+		quint64 ret = limbs()[0];
+		if (count < LIMB_BITS)
+			ret &= (static_cast<quint64>(1) << count) - 1;
+		return static_cast<T>(ret);
 	}
 
 	BigInteger operator + (const BigInteger &num) const;
 	BigInteger operator + (int num) const;
-    BigInteger operator + (uint num) const;
-    BigInteger operator + (ulong num) const;
+	BigInteger operator + (uint num) const;
+	BigInteger operator + (ulong num) const;
 	BigInteger& operator += (const BigInteger &num);
-	BigInteger& operator += (int num);
+	inline BigInteger& operator += (int num)
+	{
+		if (m_size == 1)
+		{
+			qint64 a = static_cast<qint64>(limbs()[0]);
+			quint64 r = static_cast<quint64>(a) + static_cast<quint64>(static_cast<qint64>(num));
+			// No overflow unless the operands share a sign the result lacks
+			if (((static_cast<quint64>(a) ^ r) & (static_cast<quint64>(static_cast<qint64>(num)) ^ r)) >> (LIMB_BITS - 1) == 0)
+			{
+				limbs()[0] = r;
+				return *this;
+			}
+		}
+		return *this += BigInteger(num);
+	}
 
 	BigInteger operator - (const BigInteger &num) const;
 	BigInteger operator - (int num) const;
-    BigInteger operator - (uint num) const;
-    BigInteger operator - (ulong num) const;
+	BigInteger operator - (uint num) const;
+	BigInteger operator - (ulong num) const;
 	BigInteger& operator -= (const BigInteger &num);
 	BigInteger& operator -= (int num);
 
 	BigInteger operator * (int num) const;
+	/// Divides by |num| rounding towards negative infinity, then negates for a negative num
 	BigInteger operator / (int num) const;
 
-    BigInteger operator << (int num) const;
-    BigInteger operator << (uint num) const;
-    BigInteger& operator <<= (uint num);
+	BigInteger operator << (int num) const;
+	BigInteger operator << (uint num) const;
+	BigInteger& operator <<= (uint num);
 
-    BigInteger operator >> (int num) const;
-    BigInteger operator >> (uint num) const;
-    BigInteger& operator >>= (uint num);
+	/// Rounds towards negative infinity
+	BigInteger operator >> (int num) const;
+	BigInteger operator >> (uint num) const;
+	BigInteger& operator >>= (uint num);
 
 	bool operator == (const BigInteger &num) const;
 	bool operator == (int num) const;
@@ -103,13 +122,43 @@ public:
 	bool operator >= (const BigInteger &num) const;
 	bool operator >= (int num) const;
 
-/*	friend QDebug operator << (QDebug dbg, const BigInteger &num)
+	friend QDebug operator << (QDebug dbg, const BigInteger &num)
 	{
-		char *str = mpz_get_str(NULL, 10, num.data);
-		dbg.nospace() << str;
-		delete str;
+		dbg.nospace() << static_cast<QString>(num);
 		return dbg.space();
-    }*/
+	}
+
+private:
+	static const int INLINE_LIMBS = 2;
+	static const size_t LIMB_BITS = 64;
+
+	inline quint64 *limbs() { return m_capacity > INLINE_LIMBS? m_heap: m_inline; }
+	inline const quint64 *limbs() const { return m_capacity > INLINE_LIMBS? m_heap: m_inline; }
+	/// Limb id, sign extended past the stored ones
+	inline quint64 limb(size_t id) const
+	{
+		if (id < static_cast<size_t>(m_size))
+			return limbs()[id];
+		return negative()? ~static_cast<quint64>(0): 0;
+	}
+	inline bool negative() const { return limbs()[m_size - 1] >> (LIMB_BITS - 1); }
+
+	void setSigned(qint64 num);
+	void setUnsigned(quint64 num);
+	void resize(int size);
+	void normalize();
+	void add(const BigInteger &num, bool subtract);
+	void shiftLeft(size_t count);
+	void shiftRight(size_t count);
+	void negate();
+	int compare(const BigInteger &num) const;
+
+	int m_size, m_capacity;
+	union
+	{
+		quint64 m_inline[INLINE_LIMBS];
+		quint64 *m_heap;
+	};
 };
 
 #endif
@@ -21,16 +21,32 @@
 #include "AlgorithmManager.h"
 #include "BigInteger.h"
 #include "CanvasPainter.h"
+#include "TileCache.h"
 
-CanvasPainter::CanvasPainter(QPaintDevice *device, const BigInteger &view_x, const BigInteger &view_y, int x1, int x2, int y1, int y2, int scale, int scalePixel)
-	: QPainter(device), m_view_x(view_x), m_view_y(view_y), m_scalePixel(scalePixel), m_x1(x1), m_x2(x2), m_y1(y1), m_y2(y2), m_w(x2 - x1 + 1), m_h(y2 - y1 + 1)
+CanvasPainter::CanvasPainter(QPaintDevice *device, const BigInteger &view_x, const BigInteger &view_y, int x1, int x2, int y1, int y2, int scale, int scalePixel, TileCache *tileCache)
+	: QPainter(device), m_view_x(view_x), m_view_y(view_y), m_scalePixel(scalePixel), m_x1(x1), m_x2(x2), m_y1(y1), m_y2(y2), m_w(x2 - x1 + 1), m_h(y2 - y1 + 1), m_overlay(false)
 {
 	// Draw background
 	fillRect(0, 0, device->width(), device->height(), QColor(0x80, 0x80, 0x80));
 
 	m_data = (QRgb *) malloc(m_w * m_h * sizeof(QRgb));
 	// Draw grid
-	AlgorithmManager::algorithm()->paint(this, view_x + x1, view_y + y1, m_w, m_h, scale);
+	if (tileCache)
+		paintTiles(tileCache, view_x + x1, view_y + y1, scale);
+	else
+		AlgorithmManager::algorithm()->paint(this, view_x + x1, view_y + y1, m_w, m_h, scale);
+}
+
+CanvasPainter::CanvasPainter(QPaintDevice *device, const QImage &frame, const BigInteger &view_x, const BigInteger &view_y, int x1, int x2, int y1, int y2, int scalePixel)
+	: QPainter(device), m_view_x(view_x), m_view_y(view_y), m_scalePixel(scalePixel), m_x1(x1), m_x2(x2), m_y1(y1), m_y2(y2), m_w(x2 - x1 + 1), m_h(y2 - y1 + 1), m_overlay(true)
+{
+	if (frame.isNull())
+		fillRect(0, 0, device->width(), device->height(), QColor(0x80, 0x80, 0x80));
+	else
+		drawImage(0, 0, frame);
+
+	// Transparent until drawn
+	m_data = (QRgb *) calloc(m_w * m_h, sizeof(QRgb));
 }
 
 CanvasPainter::~CanvasPainter()
@@ -38,9 +54,42 @@ CanvasPainter::~CanvasPainter()
 	free(m_data);
 }
 
+void CanvasPainter::paintTiles(TileCache *tileCache, const BigInteger &x, const BigInteger &y, int scale)
+{
+	const int size = TileCache::TILE_SIZE;
+	tileCache->beginFrame();
+	BigInteger tile_x = x >> TileCache::TILE_BITS, tile_y = y >> TileCache::TILE_BITS;
+	// The coordinate of the upper left grid in the first tile
+	int offset_x = x.lowbits<int>(TileCache::TILE_BITS), offset_y = y.lowbits<int>(TileCache::TILE_BITS);
+	QRgb *canvas = m_data;
+	int w = m_w, h = m_h;
+	for (int ty = 0; ty * size - offset_y < h; ty++)
+		for (int tx = 0; tx * size - offset_x < w; tx++)
+		{
+			BigInteger tx1 = tile_x + tx, ty1 = tile_y + ty;
+			QRgb *tile = tileCache->tile(tx1, ty1, scale);
+			if (!tile)
+			{
+				// The algorithm draws into the tile meanwhile
+				tile = tileCache->newTile(tx1, ty1, scale);
+				m_data = tile;
+				m_w = m_h = size;
+				AlgorithmManager::algorithm()->paint(this, tx1 << TileCache::TILE_BITS, ty1 << TileCache::TILE_BITS, size, size, scale);
+				m_data = canvas;
+				m_w = w;
+				m_h = h;
+			}
+			// The part of the tile inside the canvas
+			int x1 = qMax(tx * size - offset_x, 0), x2 = qMin((tx + 1) * size - offset_x, w);
+			int y1 = qMax(ty * size - offset_y, 0), y2 = qMin((ty + 1) * size - offset_y, h);
+			for (int i = y1; i < y2; i++)
+				memcpy(canvas + i * w + x1, tile + (i + offset_y - ty * size) * size + x1 + offset_x - tx * size, (x2 - x1) * sizeof(QRgb));
+		}
+}
+
 void CanvasPainter::drawPattern()
 {
-	QImage image(reinterpret_cast<uchar *>(m_data), m_w, m_h, QImage::Format_RGB32);
+	QImage image(reinterpret_cast<uchar *>(m_data), m_w, m_h, m_overlay? QImage::Format_ARGB32: QImage::Format_RGB32);
 	drawImage(m_x1, m_y1, image.scaled(m_w << m_scalePixel, m_h << m_scalePixel));
 }
 
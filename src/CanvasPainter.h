@@ -20,15 +20,21 @@
 #ifndef CANVASPAINTER_H
 #define CANVASPAINTER_H
 
+#include <cmath>
+
 #include <QRgb>
 #include <QPainter>
 
 #include "BigInteger.h"
 
+class TileCache;
 class CanvasPainter: public QPainter
 {
 public:
-	CanvasPainter(QPaintDevice *device, const BigInteger &view_x, const BigInteger &view_y, int x1, int x2, int y1, int y2, int scale, int scalePixel);
+	/// With a tile cache the grids are copied from its tiles, which are rendered when missing
+	CanvasPainter(QPaintDevice *device, const BigInteger &view_x, const BigInteger &view_y, int x1, int x2, int y1, int y2, int scale, int scalePixel, TileCache *tileCache = NULL);
+	/// Draws a finished frame, then drawPattern() only draws the grids drawn by drawGrid() over it
+	CanvasPainter(QPaintDevice *device, const QImage &frame, const BigInteger &view_x, const BigInteger &view_y, int x1, int x2, int y1, int y2, int scalePixel);
 	virtual ~CanvasPainter();
 
 	inline int width() const { return m_w; }
@@ -43,15 +49,32 @@ public:
 		m_data[y * m_w + x] = state? qRgb(0xFF, 0xFF, 0xFF): qRgb(0x30, 0x30, 0x30);
 	}
 
+	/// Shades a grid standing for 2^depth x 2^depth cells by the part of them alive
+	inline void drawDensity(int x, int y, quint64 population, size_t depth)
+	{
+		if (!population)
+		{
+			drawGrid(x, y, 0);
+			return;
+		}
+		// Sparse patterns would hardly show with a linear scale
+		double density = qMin(sqrt(ldexp(static_cast<double>(population), -2 * static_cast<int>(depth))), 1.0);
+		int level = 0x60 + static_cast<int>((0xFF - 0x60) * density);
+		m_data[y * m_w + x] = qRgb(level, level, level);
+	}
+
 	inline void fillBlack()
 	{
 		memset(m_data, 0x30, m_w * m_h * sizeof(QRgb));
 	}
 
 private:
+	void paintTiles(TileCache *tileCache, const BigInteger &x, const BigInteger &y, int scale);
+
 	QRgb *m_data;
 	BigInteger m_view_x, m_view_y;
 	int m_scalePixel, m_x1, m_x2, m_y1, m_y2, m_w, m_h;
+	bool m_overlay;
 };
 
 #endif
@@ -17,123 +17,154 @@
  *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
-#include <QMutex>
-
 #include "DataChannel.h"
 
-Q_GLOBAL_STATIC(DataChannel, globalDataChannel)
-
-DataChannel::DataChannel()
-	: m_idle(true)
+DataChannel::DataChannel(DataSender *sender, DataReceiver *receiver)
+	: m_sender(sender),
+	  m_receiver(receiver),
+	  m_published(0),
+	  m_consumed(0),
+	  m_sent(0),
+	  m_sendLen(0),
+	  m_sendEnd(false),
+	  m_bits(0),
+	  m_bitCount(0),
+	  m_received(0),
+	  m_receivePos(0),
+	  m_receiveLen(0),
+	  m_receiving(false),
+	  m_receiveEnd(false)
 {
 }
 
 void DataChannel::transfer(DataSender *sender, DataReceiver *receiver)
 {
-    globalDataChannel()->prepareTransfer(sender, receiver);
-    globalDataChannel()->start();
-    sender->send(globalDataChannel());
+	DataChannel *channel = new DataChannel(NULL, receiver);
+	channel->start();
+	sender->send(channel);
 }
 
 DataChannel *DataChannel::transferTo(DataReceiver *receiver)
 {
-    globalDataChannel()->prepareTransfer(NULL, receiver);
-    globalDataChannel()->start();
-    return globalDataChannel();
+	DataChannel *channel = new DataChannel(NULL, receiver);
+	channel->start();
+	return channel;
 }
 
 DataChannel *DataChannel::transferFrom(DataSender *sender)
 {
-    globalDataChannel()->prepareTransfer(sender, NULL);
-    globalDataChannel()->start();
-    return globalDataChannel();
+	DataChannel *channel = new DataChannel(sender, NULL);
+	channel->start();
+	return channel;
 }
 
 void DataChannel::send(int state, quint64 cnt)
 {
-	if (sendEnd)
+	if (m_sendEnd)
 		qFatal("DataChannel::send(): data is already ended.");
-	if (bufLen[flipSend] == BUFFER_SIZE)
+	// Only two state cells are packed
+	if (state < 0 || state > 1)
 	{
-		mutex.lock();
-		flipSend = !flipSend;
-		if (flipSend == flipReceive)
-			bufReadOut.wait(&mutex);
-		else
-			bufFillIn.wakeAll();
-		bufLen[flipSend] = 0;
-		mutex.unlock();
+		flushBits();
+		put(state, cnt);
+		return;
 	}
-	bufState[flipSend][bufLen[flipSend]] = state;
-	bufCnt[flipSend][bufLen[flipSend]] = cnt;
-	bufLen[flipSend]++;
-	if (state == DATACHANNEL_EOF)
+	while (cnt)
 	{
-		mutex.lock();
-		flipSend = !flipSend;
-		if (flipSend == flipReceive)
-			bufReadOut.wait(&mutex);
-		else
-			bufFillIn.wakeAll();
-		mutex.unlock();
-		if (m_receiver) // Main thread is sender
+		if (m_bitCount == 0 && cnt >= BITS_PER_ENTRY)
 		{
-			wait();
+			put(state, cnt);
 			return;
 		}
-		sendEnd = true;
+		quint64 d = qMin(cnt, BITS_PER_ENTRY - m_bitCount);
+		if (state)
+			m_bits |= ((Q_UINT64_C(1) << d) - 1) << m_bitCount;
+		m_bitCount += d;
+		cnt -= d;
+		if (m_bitCount == BITS_PER_ENTRY)
+			flushBits();
 	}
 }
 
 void DataChannel::receive(int *state, quint64 *cnt)
 {
-	if (receiveEnd)
+	if (m_receiveEnd)
 		qFatal("DataChannel::receive(): End of data!");
-	if (bufPos == bufLen[flipReceive])
+	if (m_receivePos == m_receiveLen)
 	{
-		mutex.lock();
-		flipReceive = !flipReceive;
-		if (flipSend == flipReceive)
-			bufFillIn.wait(&mutex);
-		else
-			bufReadOut.wakeAll();
-		bufPos = 0;
-		mutex.unlock();
+		if (m_receiving)
+			m_consumed.fetchAndStoreRelease(++m_received);
+		int spins = 0;
+		while (m_published.fetchAndAddAcquire(0) == m_received)
+			backoff(spins);
+		m_receiving = true;
+		m_receivePos = 0;
+		m_receiveLen = m_buffers[m_received % BUFFER_COUNT].len;
 	}
-	*state = bufState[flipReceive][bufPos];
-	*cnt = bufCnt[flipReceive][bufPos];
+	const Buffer &buffer = m_buffers[m_received % BUFFER_COUNT];
+	*state = buffer.state[m_receivePos];
+	*cnt = buffer.cnt[m_receivePos];
+	m_receivePos++;
 	if (*state == DATACHANNEL_EOF)
 	{
-		if (!m_receiver) // Main thread is receiver
-		{
-			wait();
-			return;
-		}
-		receiveEnd = true;
+		m_receiveEnd = true;
+		if (!m_receiver) // Calling thread is receiver
+			finish();
+	}
+}
+
+void DataChannel::put(int state, quint64 cnt)
+{
+	if (m_sendLen == 0)
+	{
+		// Wait for the buffer to be given back
+		int spins = 0;
+		while (m_sent - m_consumed.fetchAndAddAcquire(0) == BUFFER_COUNT)
+			backoff(spins);
+	}
+	Buffer &buffer = m_buffers[m_sent % BUFFER_COUNT];
+	buffer.state[m_sendLen] = state;
+	buffer.cnt[m_sendLen] = cnt;
+	if (++m_sendLen == BUFFER_SIZE || state == DATACHANNEL_EOF)
+		publish();
+	if (state == DATACHANNEL_EOF)
+	{
+		m_sendEnd = true;
+		if (m_receiver) // Calling thread is sender
+			finish();
 	}
-	bufPos++;
 }
 
-void DataChannel::lock()
+void DataChannel::flushBits()
 {
-	if (!m_idle.fetchAndStoreAcquire(false))
-		qFatal("DataChannel::lock(): DataChannel is in use!");
+	if (m_bitCount == 0)
+		return;
+	put(DATACHANNEL_BITS, m_bits | (Q_UINT64_C(1) << m_bitCount));
+	m_bits = 0;
+	m_bitCount = 0;
 }
 
-void DataChannel::unlock()
+void DataChannel::publish()
 {
-	m_idle.fetchAndStoreRelease(true);
+	m_buffers[m_sent % BUFFER_COUNT].len = m_sendLen;
+	m_published.fetchAndStoreRelease(++m_sent);
+	m_sendLen = 0;
 }
 
-void DataChannel::prepareTransfer(DataSender *sender, DataReceiver *receiver)
+// Called by the end in the calling thread after DATACHANNEL_EOF
+void DataChannel::finish()
 {
-    globalDataChannel()->lock();
-	m_sender = sender;
-	m_receiver = receiver;
-	bufPos = bufLen[0] = bufLen[1] = 0;
-	flipSend = 0;
-	flipReceive = 1;
-	sendEnd = receiveEnd = false;
+	wait();
+	delete this;
+}
+
+// The other end only stalls once per buffer, so yield first and sleep if that is not enough
+void DataChannel::backoff(int &spins)
+{
+	if (++spins < 64)
+		yieldCurrentThread();
+	else
+		usleep(100);
 }
 
 void DataChannel::run()
@@ -142,5 +173,4 @@ void DataChannel::run()
 		m_receiver->receive(this);
 	else
 		m_sender->send(this);
-	unlock();
 }
@@ -20,12 +20,12 @@
 #ifndef DATACHANNEL_H
 #define DATACHANNEL_H
 
-#include <QMutex>
+#include <QAtomicInt>
 #include <QThread>
-#include <QWaitCondition>
 
 #define BUFFER_SIZE 65536
 
+#define DATACHANNEL_BITS   -3
 #define DATACHANNEL_EOF    -2
 #define DATACHANNEL_EOLN   -1
 
@@ -36,6 +36,10 @@ class DataSender
 {
 public:
 	virtual ~DataSender() {}
+	/// Gets the smallest rectangle holding every live cell, of size 0 if there is none; false if it is too large to be sent
+	virtual bool boundingRect(BigInteger *x, BigInteger *y, quint64 *w, quint64 *h) = 0;
+	virtual void setSendRect(const BigInteger &x, const BigInteger &y, quint64 w, quint64 h) = 0;
+	/// Sends the rows of the rectangle, dead cells at the end of a row and dead rows at the end may be left out
 	virtual void send(DataChannel *channel) = 0;
 };
 
@@ -47,11 +51,18 @@ public:
 	virtual void receive(DataChannel *channel) = 0;
 };
 
+/// One transfer of (state, count) runs between a sender and a receiver
+// Every transfer gets its own channel, and either end runs in a thread of
+// the channel. The entries go through a ring of BUFFER_COUNT buffers, a
+// single producer and a single consumer publishing whole buffers to each
+// other with acquire/release counters, so no lock is taken. The channel is
+// deleted once the end in the calling thread has seen DATACHANNEL_EOF.
+// Short runs of cells are packed by send() into DATACHANNEL_BITS entries,
+// whose count holds the next cells of the row from the lowest bit up,
+// followed by a stop bit; long runs are passed on as they are.
 class DataChannel: private QThread
 {
 public:
-	DataChannel();
-
 	static void transfer(DataSender *sender, DataReceiver *receiver);
 	static DataChannel *transferFrom(DataSender *sender);
 	static DataChannel *transferTo(DataReceiver *receiver);
@@ -59,22 +70,79 @@ public:
 	void send(int state, quint64 cnt);
 	void receive(int *state, quint64 *cnt);
 
+	/// Whether an entry holds cells, either a run or DATACHANNEL_BITS
+	static inline bool isCells(int state)
+	{
+		return state >= 0 || state == DATACHANNEL_BITS;
+	}
+
+	/// Number of cells an entry still holds
+	static inline quint64 cellCount(int state, quint64 cnt)
+	{
+		if (state != DATACHANNEL_BITS)
+			return cnt;
+#ifdef __GNUC__
+		return 63 - __builtin_clzll(cnt);
+#else
+		quint64 ret = 0;
+		while (cnt >>= 1)
+			ret++;
+		return ret;
+#endif
+	}
+
+	/// The next count (at most BITS_PER_ENTRY) cells of an entry, one bit each
+	static inline quint64 cellBits(int state, quint64 cnt, quint64 count)
+	{
+		quint64 mask = (Q_UINT64_C(1) << count) - 1;
+		if (state == DATACHANNEL_BITS)
+			return cnt & mask;
+		return state? mask: 0;
+	}
+
+	/// Drops the next count cells of an entry
+	static inline void skipCells(int state, quint64 &cnt, quint64 count)
+	{
+		if (state == DATACHANNEL_BITS)
+			cnt >>= count;
+		else
+			cnt -= count;
+	}
+
+	static const quint64 BITS_PER_ENTRY = 63;
+
 private:
-	void lock();
-	void unlock();
-	void prepareTransfer(DataSender *sender, DataReceiver *receiver);
+	static const int BUFFER_COUNT = 4;
+
+	struct Buffer
+	{
+		int len;
+		int state[BUFFER_SIZE];
+		quint64 cnt[BUFFER_SIZE];
+	};
+
+	DataChannel(DataSender *sender, DataReceiver *receiver);
+	void put(int state, quint64 cnt);
+	void flushBits();
+	void publish();
+	void finish();
+	void backoff(int &spins);
 	void run();
 
-	QAtomicInt m_idle;
-	QMutex mutex;
-	QWaitCondition bufReadOut, bufFillIn;
 	DataSender *m_sender;
 	DataReceiver *m_receiver;
-	volatile int flipSend, flipReceive;
-	volatile int bufState[2][BUFFER_SIZE];
-	volatile quint64 bufCnt[2][BUFFER_SIZE];
-	volatile int bufPos, bufLen[2];
-	volatile bool sendEnd, receiveEnd;
+	Buffer m_buffers[BUFFER_COUNT];
+	// Number of buffers published by the sender and given back by the receiver
+	QAtomicInt m_published, m_consumed;
+	// Sender side
+	int m_sent, m_sendLen;
+	bool m_sendEnd;
+	// Cells waiting to be packed into a DATACHANNEL_BITS entry
+	quint64 m_bits;
+	quint64 m_bitCount;
+	// Receiver side
+	int m_received, m_receivePos, m_receiveLen;
+	bool m_receiving, m_receiveEnd;
 };
 
 #endif
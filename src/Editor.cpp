@@ -17,6 +17,7 @@
  *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <QAction>
 #include <QActionGroup>
 #include <QApplication>
 #include <QEvent>
@@ -31,6 +32,7 @@
 #include "CanvasPainter.h"
 #include "DataChannel.h"
 #include "Editor.h"
+#include "RenderThread.h"
 
 static const uint maxScalePixel = 4;
 // Scale ratio is: 2^scale: 2^scalePixel
@@ -42,59 +44,70 @@ Editor::Editor(QWidget *parent)
 	  m_drawing(false), m_editMode(DrawFreehand),
 	  m_scale(0), m_scalePixel(maxScalePixel)
 {
-/*	QToolBar *toolbar = new QToolBar();
-    KAction *stepAction = new KAction(this);
-	stepAction->setText(i18n("Run a single step"));
-	stepAction->setIcon(KIcon("arrow-right"));
-	stepAction->setToolTip("Run a single step");
+	QToolBar *toolbar = new QToolBar();
+	QAction *stepAction = new QAction(this);
+	stepAction->setText(tr("Run a single step"));
+	stepAction->setIcon(QIcon::fromTheme("arrow-right"));
+	stepAction->setToolTip(tr("Run a single step"));
 	stepAction->setShortcut(Qt::Key_Space);
-	static_cast<KXmlGuiWindow *>(parent)->actionCollection()->addAction("step", stepAction);
 	connect(stepAction, SIGNAL(triggered()), AlgorithmManager::self(), SLOT(runStep()));
 	toolbar->addAction(stepAction);
 
+	QAction *runAction = new QAction(this);
+	runAction->setText(tr("Run continuously"));
+	runAction->setIcon(QIcon::fromTheme("media-playback-start"));
+	runAction->setToolTip(tr("Run continuously"));
+	runAction->setShortcut(Qt::Key_Return);
+	connect(runAction, SIGNAL(triggered()), AlgorithmManager::self(), SLOT(toggleRunning()));
+	toolbar->addAction(runAction);
+
+	QAction *cancelAction = new QAction(this);
+	cancelAction->setText(tr("Cancel step"));
+	cancelAction->setIcon(QIcon::fromTheme("process-stop"));
+	cancelAction->setToolTip(tr("Cancel the step in progress"));
+	cancelAction->setShortcut(Qt::Key_Escape);
+	connect(cancelAction, SIGNAL(triggered()), AlgorithmManager::self(), SLOT(cancelStep()));
+	toolbar->addAction(cancelAction);
+
 	toolbar->addSeparator();
 
 	QActionGroup *editTools = new QActionGroup(this);
-	KAction *freehandAction = new KAction(this);
-	freehandAction->setText(i18n("Draw freehand"));
-	freehandAction->setIcon(KIcon("draw-brush"));
-	freehandAction->setToolTip(i18n("Draw freehand"));
+	QAction *freehandAction = new QAction(this);
+	freehandAction->setText(tr("Draw freehand"));
+	freehandAction->setIcon(QIcon::fromTheme("draw-brush"));
+	freehandAction->setToolTip(tr("Draw freehand"));
 	freehandAction->setCheckable(true);
 	freehandAction->setChecked(true);
-	static_cast<KXmlGuiWindow *>(parent)->actionCollection()->addAction("draw-freehand", freehandAction);
 	connect(freehandAction, SIGNAL(triggered()), this, SLOT(freehandAction()));
 	editTools->addAction(freehandAction);
 	toolbar->addAction(freehandAction);
 
-	KAction *lineAction = new KAction(this);
-	lineAction->setText(i18n("Draw line"));
-	lineAction->setIcon(KIcon("draw-line"));
-	lineAction->setToolTip(i18n("Draw line"));
+	QAction *lineAction = new QAction(this);
+	lineAction->setText(tr("Draw line"));
+	lineAction->setIcon(QIcon::fromTheme("draw-line"));
+	lineAction->setToolTip(tr("Draw line"));
 	lineAction->setCheckable(true);
-	static_cast<KXmlGuiWindow *>(parent)->actionCollection()->addAction("draw-line", lineAction);
 	connect(lineAction, SIGNAL(triggered()), this, SLOT(lineAction()));
 	editTools->addAction(lineAction);
 	toolbar->addAction(lineAction);
 
-	KAction *rectangleAction = new KAction(this);
-	rectangleAction->setText(i18n("Draw rectangle"));
-	rectangleAction->setIcon(KIcon("draw-rectangle"));
-	rectangleAction->setToolTip(i18n("Draw rectangle"));
+	QAction *rectangleAction = new QAction(this);
+	rectangleAction->setText(tr("Draw rectangle"));
+	rectangleAction->setIcon(QIcon::fromTheme("draw-rectangle"));
+	rectangleAction->setToolTip(tr("Draw rectangle"));
 	rectangleAction->setCheckable(true);
-	static_cast<KXmlGuiWindow *>(parent)->actionCollection()->addAction("draw-rectangle", rectangleAction);
 	connect(rectangleAction, SIGNAL(triggered()), this, SLOT(rectangleAction()));
 	editTools->addAction(rectangleAction);
 	toolbar->addAction(rectangleAction);
 
-	KAction *circleAction = new KAction(this);
-	circleAction->setText(i18n("Draw circle"));
-	circleAction->setIcon(KIcon("draw-circle"));
-	circleAction->setToolTip(i18n("Draw circle"));
+	QAction *circleAction = new QAction(this);
+	circleAction->setText(tr("Draw circle"));
+	circleAction->setIcon(QIcon::fromTheme("draw-circle"));
+	circleAction->setToolTip(tr("Draw circle"));
 	circleAction->setCheckable(true);
-	static_cast<KXmlGuiWindow *>(parent)->actionCollection()->addAction("draw-circle", circleAction);
 	connect(circleAction, SIGNAL(triggered()), this, SLOT(circleAction()));
 	editTools->addAction(circleAction);
-    toolbar->addAction(circleAction);*/
+	toolbar->addAction(circleAction);
 
 	m_canvas = new QWidget();
 	m_canvas->setMouseTracking(true);
@@ -111,12 +124,16 @@ Editor::Editor(QWidget *parent)
 	rectChanged();
 	resetViewPoint();
 	connect(AlgorithmManager::self(), SIGNAL(rectChanged()), this, SLOT(rectChanged()));
-	connect(AlgorithmManager::self(), SIGNAL(gridChanged()), m_canvas, SLOT(update()));
+	// Frames are drawn by the render thread, the canvas shows the latest one
+	m_renderThread = new RenderThread();
+	connect(AlgorithmManager::self(), SIGNAL(algorithmChanged()), m_renderThread, SLOT(invalidate()));
+	connect(AlgorithmManager::self(), SIGNAL(gridChanged()), m_renderThread, SLOT(invalidate()));
+	connect(m_renderThread, SIGNAL(frameReady()), m_canvas, SLOT(update()));
 
 	QGridLayout *layout = new QGridLayout();
 	layout->setVerticalSpacing(0);
 	layout->setHorizontalSpacing(0);
-//	layout->addWidget(toolbar, 0, 0);
+	layout->addWidget(toolbar, 0, 0);
 	layout->addWidget(m_canvas, 1, 0);
 	layout->addWidget(m_vertScroll, 1, 1);
 	layout->addWidget(m_horiScroll, 2, 0);
@@ -125,6 +142,7 @@ Editor::Editor(QWidget *parent)
 
 Editor::~Editor()
 {
+	delete m_renderThread;
 	delete m_canvas;
 }
 
@@ -468,8 +486,9 @@ bool Editor::eventFilter(QObject *obj, QEvent *event)
 				x1 = qMax(x1, static_cast<int>((m_rect_x1 >> scale) - m_view_x));
 				x2 = qMin(x2, static_cast<int>((m_rect_x2 >> scale) - m_view_x));
 			}
-            CanvasPainter painter(m_canvas, m_view_x, m_view_y, x1, x2, y1, y2, qMax(m_scale, 0U), m_scalePixel);
-			if (m_drawing)
+			m_renderThread->render(m_canvas->size(), m_view_x, m_view_y, x1, x2, y1, y2, qMax(m_scale, 0U), m_scalePixel);
+			CanvasPainter painter(m_canvas, m_renderThread->frame(), m_view_x, m_view_y, x1, x2, y1, y2, m_scalePixel);
+			if (m_drawing && m_editMode != DrawFreehand)
 			{
 				if (m_editMode == DrawLine)
 					setLine(m_draw_start_x, m_draw_start_y, m_mouseMove_last_x, m_mouseMove_last_y, 1, &painter);
@@ -477,9 +496,9 @@ bool Editor::eventFilter(QObject *obj, QEvent *event)
                                         setRectangle(m_draw_start_x, m_draw_start_y, m_mouseMove_last_x, m_mouseMove_last_y, 1, &painter);
 				else if (m_editMode == DrawCircle)
 					setCircle(m_draw_start_x, m_draw_start_y, m_mouseMove_last_x, m_mouseMove_last_y, 1, &painter);
+				painter.drawPattern();
+				painter.drawGridLine();
 			}
-			painter.drawPattern();
-			painter.drawGridLine();
 			break;
 		}
 
@@ -25,6 +25,7 @@
 #include "BigInteger.h"
 
 class QScrollBar;
+class RenderThread;
 class Editor: public QWidget
 {
 	Q_OBJECT
@@ -62,6 +63,7 @@ private:
 	bool eventFilter(QObject *obj, QEvent *event);
 
 	QWidget *m_canvas;
+	RenderThread *m_renderThread;
 	QScrollBar *m_vertScroll, *m_horiScroll;
 
 	BigInteger m_mouseLastX, m_mouseLastY;
@@ -0,0 +1,64 @@
+/*
+ *   Copyright (C) 2011 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <QThread>
+
+#include "Epoch.h"
+
+Epoch::Epoch()
+	: m_epoch(1)
+{
+	for (int i = 0; i < MAX_READERS; i++)
+		m_readers[i] = 0;
+}
+
+int Epoch::enter()
+{
+	forever
+	{
+		for (int i = 0; i < MAX_READERS; i++)
+			// A stale epoch only makes the writers wait longer. The slot is
+			// set before the reader loads anything, so a writer which missed
+			// it had unlinked its data before the reader could reach it.
+			if (m_readers[i] == 0 && m_readers[i].testAndSetOrdered(0, m_epoch.fetchAndAddOrdered(0)))
+				return i;
+		QThread::yieldCurrentThread();
+	}
+}
+
+void Epoch::leave(int slot)
+{
+	m_readers[slot].fetchAndStoreOrdered(0);
+}
+
+int Epoch::advance()
+{
+	return m_epoch.fetchAndAddOrdered(1);
+}
+
+bool Epoch::isOver(int epoch)
+{
+	for (int i = 0; i < MAX_READERS; i++)
+	{
+		int entered = m_readers[i].fetchAndAddOrdered(0);
+		if (entered && entered <= epoch)
+			return false;
+	}
+	return true;
+}
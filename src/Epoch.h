@@ -0,0 +1,52 @@
+/*
+ *   Copyright (C) 2011 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <QAtomicInt>
+
+/// Tells when the readers of lock-free data have left it
+// A reader enter()s before loading a pointer to published data and leave()s
+// once done with what it reached, announcing meanwhile the epoch it entered
+// in one of MAX_READERS slots. A writer unlinking data tags it with
+// advance(), and may free it as soon as isOver() the tag: every reader still
+// able to reach it entered no later than that epoch.
+class Epoch
+{
+public:
+	Epoch();
+
+	/// Returns the slot to leave() with, waits for one if all are taken
+	int enter();
+	void leave(int slot);
+	/// Starts a new epoch and returns the one ended
+	int advance();
+	/// Whether every reader which entered during epoch or before has left
+	bool isOver(int epoch);
+
+private:
+	static const int MAX_READERS = 64;
+
+	QAtomicInt m_epoch;
+	// The epoch each reader entered, 0 for a free slot
+	QAtomicInt m_readers[MAX_READERS];
+};
+
+#endif
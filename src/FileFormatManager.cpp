@@ -51,14 +51,15 @@ QString FileFormatManager::fileFilter()
     return tr("All supported formats") + "(" + globalFileFormatManager()->allExtensions + ")" + globalFileFormatManager()->filters;
 }
 
+AbstractFileFormat *FileFormatManager::fileFormat(const QString &fileName)
+{
+	return globalFileFormatManager()->formats.value(QFileInfo(fileName).suffix());
+}
+
 bool FileFormatManager::readFile(QString fileName)
 {
-	QFileInfo info(fileName);
-	QString suffix = info.suffix();
-	AbstractFileFormat *format;
-    if (globalFileFormatManager()->formats.count(suffix))
-        format = globalFileFormatManager()->formats[suffix];
-	else
+	AbstractFileFormat *format = fileFormat(fileName);
+	if (!format)
 		return false;
 	QFile file(fileName);
 	if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
@@ -68,3 +69,16 @@ bool FileFormatManager::readFile(QString fileName)
 	file.close();
 	return ret;
 }
+
+bool FileFormatManager::writeFile(QString fileName)
+{
+	AbstractFileFormat *format = fileFormat(fileName);
+	if (!format)
+		return false;
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+		return false;
+	bool ret = format->writeDevice(&file, AlgorithmManager::algorithm());
+	file.close();
+	return ret;
+}
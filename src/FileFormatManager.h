@@ -33,7 +33,10 @@ public:
 	static FileFormatManager *self();
 	static void registerFileFormat(AbstractFileFormat *format);
 	static QString fileFilter();
+	/// The format of a file by its suffix, NULL if none is registered
+	static AbstractFileFormat *fileFormat(const QString &fileName);
 	static bool readFile(QString fileName);
+	static bool writeFile(QString fileName);
 
 private:
 	QString filters, allExtensions;
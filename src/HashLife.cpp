@@ -17,8 +17,21 @@
  *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <new>
+
+#include <QAtomicPointer>
+#include <QHash>
+#include <QIODevice>
+#include <QMutex>
+#include <QThread>
+#include <QTime>
+#include <QtAlgorithms>
+
 #include "AlgorithmManager.h"
+#include "DataChannel.h"
 #include "HashLife.h"
+#include "LifeKernel.h"
+#include "MemoryManager.h"
 #include "RuleLife.h"
 #include "TreeUtils.h"
 
@@ -29,152 +42,658 @@ REGISTER_ALGORITHM(HashLife)
 #define dl child[2]
 #define dr child[3]
 
-struct Block
+typedef HashLife::Block Block;
+typedef HashLife::Node Node;
+
+// Final avalanche of MurmurHash3
+static inline quint64 mixHash(quint64 h)
+{
+	h ^= h >> 33;
+	h *= Q_UINT64_C(0xFF51AFD7ED558CCD);
+	h ^= h >> 33;
+	h *= Q_UINT64_C(0xC4CEB9FE1A85EC53);
+	h ^= h >> 33;
+	return h;
+}
+
+// Populations of more cells than a quint64 holds are kept as POPULATION_MAX
+static const quint64 POPULATION_MAX = ~Q_UINT64_C(0);
+
+static inline quint64 addPopulation(quint64 a, quint64 b)
+{
+	return a + b < a? POPULATION_MAX: a + b;
+}
+
+/// 8x8 leaf, cell (x, y) is bit y * SIZE + x
+// population comes first in both Block and Node, so a node can sum up its
+// children without knowing whether they are blocks.
+struct HashLife::Block
 {
-	static const size_t DEPTH = 1;
+	static const size_t DEPTH = 3;
 	static const size_t SIZE = 1 << DEPTH;
 
-	Block *next;
+	typedef quint64 Key;
 
-	unsigned char child[4];
-	int population;
+	quint64 population;
+	quint64 data;
+	bool marked;
 
 	Block() {}
-	Block(unsigned char c0, unsigned char c1, unsigned char c2, unsigned char c3)
+	Block(quint64 data)
+		: population(popCount(data)), data(data), marked(false)
 	{
-		child[0] = c0;
-		child[1] = c1;
-		child[2] = c2;
-		child[3] = c3;
-		population = (c0 > 0) + (c1 > 0) + (c2 > 0) + (c3 > 0);
 	}
 
-	inline int get(int x, int y)
+	inline bool equals(quint64 key) const
 	{
-		return child[(y << 1) | x];
+		return data == key;
 	}
 
-	inline bool visible(HashLife *)
+	inline int get(int x, int y) const
 	{
-		return population > 0;
+		return TEST_BIT(data, y * SIZE + x) > 0;
 	}
 
-	static inline ulong hash(unsigned char c0, unsigned char c1, unsigned char c2, unsigned c3)
+	inline int getRow(int y) const
 	{
-		return 5 * c0 + 17 * c1 + 257 * c2 + 65537 * c3;
+		return (data >> (y * SIZE)) & (BIT(SIZE, quint64) - 1);
 	}
 
-	static inline void runStep(Rule *rule, unsigned char &rul, unsigned char &rur, unsigned char &rdl, unsigned char &rdr, Block *bul, Block *bur, Block *bdl, Block *bdr)
+	inline bool visible(HashLife *) const
 	{
-		if (rule->type() == Rule::Life)
+		return data != 0;
+	}
+
+	static inline quint64 hash(quint64 key)
+	{
+		return mixHash(key);
+	}
+
+	/// The centre 8x8 of the 16x16 square made of 4 blocks
+	static inline quint64 centre(quint64 b0, quint64 b1, quint64 b2, quint64 b3)
+	{
+		// Rows 4-7 of the upper blocks and rows 0-3 of the lower ones,
+		// taking the right half of each left row and the left half of each right row
+		quint64 upper = ((b0 >> 36) & Q_UINT64_C(0x0F0F0F0F)) | ((b1 >> 28) & Q_UINT64_C(0xF0F0F0F0));
+		quint64 lower = ((b2 >> 4) & Q_UINT64_C(0x0F0F0F0F)) | ((b3 << 4) & Q_UINT64_C(0xF0F0F0F0));
+		return upper | (lower << 32);
+	}
+
+	/// Computes the centre 8x8 of the 16x16 square made of 4 blocks after 2^exponent (at most 4) generations
+	// The square is kept as 4 words of 4 rows, 16 bits per row, and every
+	// generation is computed for all cells at once with a bit-sliced adder.
+	// The outermost ring of cells gets wrong values each generation as its
+	// neighbours outside the square are unknown (horizontal shifts even mix in
+	// bits of the adjacent row), but after at most 4 generations the garbage
+	// never reaches the centre.
+	static inline quint64 runStep(RuleLife *rule, size_t exponent, quint64 b0, quint64 b1, quint64 b2, quint64 b3)
+	{
+		quint64 area[4] = {0, 0, 0, 0};
+		for (size_t y = 0; y < SIZE; y++)
 		{
-			// * * * 0
-			// * x * 0
-			// * * * 0
-			// 0 0 0 0
-			int cul = bul->ul + bul->ur + bul->dl + bur->ul + bur->dl + bdl->ul + bdl->ur + bdr->ul;
-			rul = reinterpret_cast<RuleLife *>(rule)->nextState(bul->dr, cul);
-			// 0 * * *
-			// 0 * x *
-			// 0 * * *
-			// 0 0 0 0
-			int cur = bul->ur + bul->dr + bur->ul + bur->ur + bur->dr + bdl->ur + bdr->ul + bdr->ur;
-			rur = reinterpret_cast<RuleLife *>(rule)->nextState(bur->dl, cur);
-			// 0 0 0 0
-			// * * * 0
-			// * x * 0
-			// * * * 0
-			int cdl = bul->dl + bul->dr + bur->dl + bdl->ul + bdl->dl + bdl->dr + bdr->ul + bdr->dl;
-			rdl = reinterpret_cast<RuleLife *>(rule)->nextState(bdl->ur, cdl);
-			// 0 0 0 0
-			// 0 * * *
-			// 0 * x *
-			// 0 * * *
-			int cdr = bul->dr + bur->dl + bur->dr + bdl->ur + bdl->dr + bdr->ur + bdr->dl + bdr->dr;
-			rdr = reinterpret_cast<RuleLife *>(rule)->nextState(bdr->ul, cdr);
+			area[y >> 2] |= (((b0 >> (y * SIZE)) & 0xFF) | (((b1 >> (y * SIZE)) & 0xFF) << 8)) << ((y & 3) * 16);
+			area[(y + SIZE) >> 2] |= (((b2 >> (y * SIZE)) & 0xFF) | (((b3 >> (y * SIZE)) & 0xFF) << 8)) << ((y & 3) * 16);
 		}
-		else
+		for (int generation = 1 << exponent; generation > 0; generation--)
 		{
-			// Should not run into here actually
-			// Just avoids gcc warning of uninitialized variables
-			rul = rur = rdl = rdr = 0;
+			quint64 next[4];
+			for (int i = 0; i < 4; i++)
+			{
+				quint64 up = (area[i] << 16) | (i > 0? area[i - 1] >> 48: 0);
+				quint64 down = (area[i] >> 16) | (i < 3? area[i + 1] << 48: 0);
+				quint64 count[4];
+				countNeighbours(count, up << 1, up, up >> 1, area[i] << 1, area[i] >> 1, down << 1, down, down >> 1);
+				next[i] = rule->nextStates(area[i], count[0], count[1], count[2], count[3]);
+			}
+			area[0] = next[0];
+			area[1] = next[1];
+			area[2] = next[2];
+			area[3] = next[3];
 		}
+		// Rows 4-11, columns 4-11
+		quint64 ret = 0;
+		for (size_t y = 0; y < SIZE; y++)
+			ret |= ((area[(y + 4) >> 2] >> (((y + 4) & 3) * 16 + 4)) & 0xFF) << (y * SIZE);
+		return ret;
 	}
 };
 
-struct Node
+struct HashLife::Node
 {
-	Node *next;
+	struct Key
+	{
+		Key(Node *c0, Node *c1, Node *c2, Node *c3)
+		{
+			child[0] = c0;
+			child[1] = c1;
+			child[2] = c2;
+			child[3] = c3;
+		}
 
+		Node *child[4];
+	};
+
+	quint64 population;
 	Node *child[4];
-	Node *result;
+	// Written by whichever thread computes it first
+	QAtomicPointer<Node> result;
+	bool marked;
+	// The generations result is ahead by, 2^resultStep
+	QAtomicInt resultStep;
 
 	Node() {}
-	Node(Node *c0, Node *c1, Node *c2, Node *c3)
+	Node(const Key &key)
 	{
-		child[0] = c0;
-		child[1] = c1;
-		child[2] = c2;
-		child[3] = c3;
+		child[0] = key.child[0];
+		child[1] = key.child[1];
+		child[2] = key.child[2];
+		child[3] = key.child[3];
+		population = addPopulation(addPopulation(child[0]->population, child[1]->population), addPopulation(child[2]->population, child[3]->population));
 		result = NULL;
+		marked = false;
+		resultStep = 0;
+	}
+
+	// A result computed for another step is kept, to be used again when
+	// the step changes back; nodes lower than both steps never lose theirs
+	inline Node *cachedResult(int step)
+	{
+		if (resultStep.fetchAndAddAcquire(0) != step)
+			return NULL;
+		return result;
+	}
+
+	inline Node *setResult(Node *node, int step)
+	{
+		result = node;
+		resultStep.fetchAndStoreRelease(step);
+		return node;
 	}
 
-	inline bool visible(HashLife *algorithm, size_t depth)
+	inline bool equals(const Key &key) const
 	{
-		return this != algorithm->emptyNode(depth);
+		return child[0] == key.child[0] && child[1] == key.child[1] && child[2] == key.child[2] && child[3] == key.child[3];
 	}
 
-	static inline ulong hash(Node *c0, Node *c1, Node *c2, Node *c3)
+	// Readers of snapshots must not touch m_emptyNode, which the writer may grow
+	inline bool visible(HashLife *, size_t)
 	{
-		return 5 * reinterpret_cast<ulong>(c0) + 17 * reinterpret_cast<ulong>(c1) + 257 * reinterpret_cast<ulong>(c2) + 65537 * reinterpret_cast<ulong>(c3);
+		return population != 0;
+	}
+
+	static inline quint64 hash(const Key &key)
+	{
+		// Children are allocated from MemoryManager chunks, so their addresses
+		// share the low bits and most of the high bits. Mix them thoroughly,
+		// the table takes the lowest bits as the slot index.
+		return mixHash(reinterpret_cast<quintptr>(key.child[0]) * Q_UINT64_C(0x9E3779B97F4A7C15)
+				+ reinterpret_cast<quintptr>(key.child[1]) * Q_UINT64_C(0xC2B2AE3D27D4EB4F)
+				+ reinterpret_cast<quintptr>(key.child[2]) * Q_UINT64_C(0x165667B19E3779F9)
+				+ reinterpret_cast<quintptr>(key.child[3]) * Q_UINT64_C(0x27D4EB2F165667C5));
 	}
 };
 
-template <typename T, typename subtype>
-class HashTable
+/// One shard of the canonicalizing hash table for HashLife nodes and blocks
+// Open addressing with linear probing. Every slot caches the full hash of its
+// node, so a probe only dereferences a node whose hash matches: a lookup
+// touches the slot cache line plus the node itself.
+// Nodes are allocated from the MemoryManager chunks so they are packed
+// contiguously instead of being scattered across the heap by new.
+// When the load factor exceeds 1/2 the table doubles its size, but the old
+// slots are moved to the new array incrementally (MIGRATE_STEP slots per
+// insertion) to avoid long pauses in the middle of runNode(). During the
+// migration lookups have to check both arrays.
+template <typename T>
+class HashTableShard
 {
 public:
-	HashTable()
+	HashTableShard(MemoryManager *memoryManager)
+		: m_memoryManager(memoryManager), m_count(0),
+		  m_slots(new Slot[INITIAL_SIZE]()), m_mask(INITIAL_SIZE - 1),
+		  m_oldSlots(NULL), m_oldMask(0), m_migrated(0)
+	{
+	}
+
+	~HashTableShard()
+	{
+		for (size_t i = 0; i <= m_mask; i++)
+			if (m_slots[i].node)
+				m_memoryManager->deleteObject(m_slots[i].node);
+		// Slots not migrated yet are only in the old array
+		if (m_oldSlots)
+			for (size_t i = m_migrated; i <= m_oldMask; i++)
+				if (m_oldSlots[i].node)
+					m_memoryManager->deleteObject(m_oldSlots[i].node);
+		delete[] m_slots;
+		delete[] m_oldSlots;
+	}
+
+	inline size_t size() const { return m_count; }
+
+	inline quint64 memoryUsage() const
 	{
-		memset(data, 0, sizeof data);
+		return m_count * sizeof(T) + (m_mask + 1 + (m_oldSlots? m_oldMask + 1: 0)) * sizeof(Slot);
 	}
 
-	~HashTable()
+	/// Frees every node not marked by the collector and clears the marks of the others
+	// The survivors are rehashed into a fresh array sized for them, so the
+	// table shrinks back after a big collection.
+	void sweep()
 	{
-		for (ulong i = 0; i < SIZE; i++)
-			for (T *p = data[i]; p;)
+		size_t survivors = 0;
+		for (size_t i = 0; i <= m_mask; i++)
+			survivors += m_slots[i].node && m_slots[i].node->marked;
+		if (m_oldSlots)
+			for (size_t i = m_migrated; i <= m_oldMask; i++)
+				survivors += m_oldSlots[i].node && m_oldSlots[i].node->marked;
+		size_t mask = INITIAL_SIZE - 1;
+		while (survivors * 2 > mask + 1)
+			mask = mask * 2 + 1;
+		Slot *table = new Slot[mask + 1]();
+		sweep(m_slots, 0, m_mask, table, mask);
+		if (m_oldSlots)
+		{
+			sweep(m_oldSlots, m_migrated, m_oldMask, table, mask);
+			delete[] m_oldSlots;
+			m_oldSlots = NULL;
+		}
+		delete[] m_slots;
+		m_slots = table;
+		m_mask = mask;
+		m_count = survivors;
+	}
+
+	void clearResults()
+	{
+		for (size_t i = 0; i <= m_mask; i++)
+			if (m_slots[i].node)
+				m_slots[i].node->result = NULL;
+		if (m_oldSlots)
+			for (size_t i = m_migrated; i <= m_oldMask; i++)
+				if (m_oldSlots[i].node)
+					m_oldSlots[i].node->result = NULL;
+	}
+
+	T *get(quint64 h, const typename T::Key &key)
+	{
+		T *p = find(m_slots, m_mask, h, key);
+		if (p)
+			return p;
+		// Already migrated slots are also in m_slots, so it is safe to return
+		// a node found here without moving it
+		if (m_oldSlots && (p = find(m_oldSlots, m_oldMask, h, key)))
+			return p;
+		p = new (m_memoryManager->newObject<T>()) T(key);
+		insert(m_slots, m_mask, h, p);
+		m_count++;
+		if (m_oldSlots)
+			migrate();
+		else if (m_count * 2 > m_mask + 1)
+			grow();
+		return p;
+	}
+
+private:
+	struct Slot
+	{
+		quint64 hash;
+		T *node;
+	};
+
+	static const size_t INITIAL_SIZE = 1 << 16;
+	static const size_t MIGRATE_STEP = 4;
+
+	static inline T *find(Slot *table, size_t mask, quint64 h, const typename T::Key &key)
+	{
+		for (size_t i = h & mask; table[i].node; i = (i + 1) & mask)
+			if (table[i].hash == h && table[i].node->equals(key))
+				return table[i].node;
+		return NULL;
+	}
+
+	static inline void insert(Slot *table, size_t mask, quint64 h, T *node)
+	{
+		size_t i = h & mask;
+		while (table[i].node)
+			i = (i + 1) & mask;
+		table[i].hash = h;
+		table[i].node = node;
+	}
+
+	void sweep(Slot *from, size_t begin, size_t fromMask, Slot *to, size_t toMask)
+	{
+		for (size_t i = begin; i <= fromMask; i++)
+		{
+			T *p = from[i].node;
+			if (!p)
+				continue;
+			if (p->marked)
 			{
-				T *q = p;
-				p = q->next;
-				delete q;
+				p->marked = false;
+				insert(to, toMask, from[i].hash, p);
 			}
+			else
+				m_memoryManager->deleteObject(p);
+		}
 	}
 
-    T *get(subtype c0, subtype c1, subtype c2, subtype c3)
+	void grow()
+	{
+		// The previous migration always finishes before the next grow():
+		// the old array holds at most (m_mask + 1) / 2 nodes and is drained
+		// after (m_mask + 1) / MIGRATE_STEP insertions, long before the new
+		// array reaches its own load limit.
+		m_oldSlots = m_slots;
+		m_oldMask = m_mask;
+		m_migrated = 0;
+		m_mask = m_mask * 2 + 1;
+		m_slots = new Slot[m_mask + 1]();
+	}
+
+	void migrate()
+	{
+		size_t end = qMin(m_migrated + MIGRATE_STEP, m_oldMask + 1);
+		for (; m_migrated < end; m_migrated++)
+			if (m_oldSlots[m_migrated].node)
+				insert(m_slots, m_mask, m_oldSlots[m_migrated].hash, m_oldSlots[m_migrated].node);
+		if (m_migrated > m_oldMask)
+		{
+			delete[] m_oldSlots;
+			m_oldSlots = NULL;
+		}
+	}
+
+	MemoryManager *m_memoryManager;
+	size_t m_count;
+	Slot *m_slots;
+	size_t m_mask;
+	Slot *m_oldSlots;
+	size_t m_oldMask, m_migrated;
+};
+
+/// Canonicalizing hash table shared by the threads running a step
+// The table is split into shards by the highest bits of the hash, each with
+// its own lock and its own MemoryManager, so threads creating nodes at the
+// same time rarely wait for each other.
+template <typename T>
+class HashTable
+{
+public:
+	T *get(const typename T::Key &key)
+	{
+		quint64 h = T::hash(key);
+		Shard &shard = m_shards[h >> (64 - SHARD_BITS)];
+		QMutexLocker locker(&shard.mutex);
+		return shard.table.get(h, key);
+	}
+
+	inline T *get(Node *c0, Node *c1, Node *c2, Node *c3)
+	{
+		return get(typename T::Key(c0, c1, c2, c3));
+	}
+
+	// The following functions must not run concurrently with get()
+
+	size_t size() const
+	{
+		size_t ret = 0;
+		for (int i = 0; i < SHARD_COUNT; i++)
+			ret += m_shards[i].table.size();
+		return ret;
+	}
+
+	quint64 memoryUsage() const
+	{
+		quint64 ret = 0;
+		for (int i = 0; i < SHARD_COUNT; i++)
+			ret += m_shards[i].table.memoryUsage();
+		return ret;
+	}
+
+	void sweep()
+	{
+		for (int i = 0; i < SHARD_COUNT; i++)
+			m_shards[i].table.sweep();
+	}
+
+	void clearResults()
+	{
+		for (int i = 0; i < SHARD_COUNT; i++)
+			m_shards[i].table.clearResults();
+	}
+
+	void appendManagers(QList<MemoryManager *> *managers)
+	{
+		for (int i = 0; i < SHARD_COUNT; i++)
+			managers->append(&m_shards[i].memoryManager);
+	}
+
+private:
+	static const int SHARD_BITS = 6;
+	static const int SHARD_COUNT = 1 << SHARD_BITS;
+
+	struct Shard
+	{
+		Shard(): table(&memoryManager) {}
+
+		QMutex mutex;
+		MemoryManager memoryManager;
+		HashTableShard<T> table;
+	};
+
+	Shard m_shards[SHARD_COUNT];
+};
+
+/// A runNode() call which may be executed by another thread
+struct RunNodeJob
+{
+	Node *node;
+	size_t depth;
+	Node *result;
+	QAtomicInt done;
+};
+
+/// Per thread deque of jobs
+// The owner pushes and pops jobs at the back, idle threads steal from the
+// front, where the biggest pending jobs are.
+struct JobQueue
+{
+	JobQueue(): computed(0), reported(0) {}
+
+	QMutex mutex;
+	QList<RunNodeJob *> jobs;
+	// By the owner during the step, kept here to stay apart from the other threads' counts
+	quint64 computed;
+	// A copy of computed taken every PROGRESS_NODES nodes, under mutex for reportProgress()
+	quint64 reported;
+};
+
+/// Thread helping HashLife::run() to compute a step
+class HashLifeWorker: public QThread
+{
+public:
+	HashLifeWorker(HashLife *algorithm, int id)
+		: m_algorithm(algorithm), m_id(id)
 	{
-		uint h = T::hash(c0, c1, c2, c3) % SIZE;
-		for (T *p = data[h]; p; p = p->next)
-			if (p->child[0] == c0 && p->child[1] == c1 && p->child[2] == c2 && p->child[3] == c3)
-				return p;
-		T *p = new T(c0, c1, c2, c3);
-		p->next = data[h];
-		data[h] = p;
-		return p;
 	}
 
 private:
-	static const ulong SIZE = 1000003UL;
+	virtual void run()
+	{
+		m_algorithm->workerRun(m_id);
+	}
 
-	T *data[SIZE];
+	HashLife *m_algorithm;
+	int m_id;
+};
+
+/// Builds the canonical tree of a received pattern bottom-up
+// Rows of cells are gathered into a band of blocks, and every completed band
+// is handed to the level above as a row of its non-empty nodes sorted by
+// column. A level keeps a row until the row below it arrives and joins the
+// two into a row of parents, so every node is hashed exactly once and only
+// the live area is ever visited.
+class HashLifeLoader
+{
+public:
+	HashLifeLoader(HashLife *algorithm, size_t depth)
+		: m_algorithm(algorithm), m_depth(depth), m_bandRow(0), m_levels(depth), m_root(algorithm->emptyNode(depth)),
+		  m_blocks(0), m_nodes(0)
+	{
+	}
+
+	/// Adds the live cells among count (at most 64) cells at (x, y), lowest bit first
+	// Rows must come in order, cells outside the tree are dropped.
+	void addCells(quint64 x, quint64 y, quint64 bits, quint64 count)
+	{
+		if (!bits || (y >> m_depth) || (x >> m_depth))
+			return;
+		if (!m_band.isEmpty() && (y >> Block::DEPTH) != m_bandRow)
+			flushBand();
+		m_bandRow = y >> Block::DEPTH;
+		count = qMin(count, (Q_UINT64_C(1) << m_depth) - x);
+		while (count)
+		{
+			quint64 d = qMin<quint64>(Block::SIZE - (x & (Block::SIZE - 1)), count);
+			quint64 piece = bits & ((Q_UINT64_C(1) << d) - 1);
+			if (piece)
+				m_band[x >> Block::DEPTH] |= piece << ((y & (Block::SIZE - 1)) * Block::SIZE + (x & (Block::SIZE - 1)));
+			bits >>= d;
+			x += d;
+			count -= d;
+		}
+	}
+
+	/// Adds count live cells at (x, y)
+	void addRun(quint64 x, quint64 y, quint64 count)
+	{
+		while (count && !(x >> m_depth))
+		{
+			quint64 d = qMin<quint64>(count, 64 - Block::SIZE);
+			addCells(x, y, (Q_UINT64_C(1) << d) - 1, d);
+			x += d;
+			count -= d;
+		}
+	}
+
+	/// The tree of depth m_depth holding every added cell
+	Node *finish()
+	{
+		flushBand();
+		for (size_t depth = Block::DEPTH; depth < m_depth; depth++)
+			flushLevel(depth);
+		return m_root;
+	}
+
+	quint64 blocks() const { return m_blocks; }
+	quint64 nodes() const { return m_nodes; }
+
+private:
+	typedef QVector<QPair<quint64, Node *> > Row;
+
+	struct Level
+	{
+		Level(): pending(false), row(0) {}
+
+		bool pending;
+		quint64 row;
+		Row nodes;
+	};
+
+	void flushBand()
+	{
+		if (m_band.isEmpty())
+			return;
+		QList<quint64> columns = m_band.keys();
+		qSort(columns);
+		Row row;
+		row.reserve(columns.size());
+		foreach (quint64 column, columns)
+			row.append(qMakePair(column, reinterpret_cast<Node *>(m_algorithm->m_blockHash->get(m_band.value(column)))));
+		m_blocks += row.size();
+		m_band.clear();
+		push(Block::DEPTH, m_bandRow, row);
+	}
+
+	void flushLevel(size_t depth)
+	{
+		Level &level = m_levels[depth];
+		if (!level.pending)
+			return;
+		level.pending = false;
+		push(depth + 1, level.row >> 1, join(depth, level.nodes, Row()));
+	}
+
+	/// Hands a row of nodes of the given depth to the level above
+	void push(size_t depth, quint64 row, const Row &nodes)
+	{
+		if (depth == m_depth)
+		{
+			if (!nodes.isEmpty())
+				m_root = nodes.first().second;
+			return;
+		}
+		Level &level = m_levels[depth];
+		if (level.pending && level.row + 1 == row && (row & 1))
+		{
+			level.pending = false;
+			push(depth + 1, row >> 1, join(depth, level.nodes, nodes));
+			return;
+		}
+		flushLevel(depth);
+		if (row & 1)
+			push(depth + 1, row >> 1, join(depth, Row(), nodes));
+		else
+		{
+			level.pending = true;
+			level.row = row;
+			level.nodes = nodes;
+		}
+	}
+
+	/// The row of parents of two adjacent rows of nodes of the given depth
+	Row join(size_t depth, const Row &upper, const Row &lower)
+	{
+		Node *e = m_algorithm->emptyNode(depth);
+		Row ret;
+		int i = 0, j = 0;
+		while (i < upper.size() || j < lower.size())
+		{
+			quint64 column;
+			if (j == lower.size() || (i < upper.size() && upper[i].first < lower[j].first))
+				column = upper[i].first >> 1;
+			else
+				column = lower[j].first >> 1;
+			Node *child[4] = {e, e, e, e};
+			for (; i < upper.size() && (upper[i].first >> 1) == column; i++)
+				child[upper[i].first & 1] = upper[i].second;
+			for (; j < lower.size() && (lower[j].first >> 1) == column; j++)
+				child[2 + (lower[j].first & 1)] = lower[j].second;
+			ret.append(qMakePair(column, m_algorithm->m_nodeHash->get(child[0], child[1], child[2], child[3])));
+		}
+		m_nodes += ret.size();
+		return ret;
+	}
+
+	HashLife *m_algorithm;
+	size_t m_depth;
+	// Block column -> cells of the band of rows being received
+	QHash<quint64, quint64> m_band;
+	quint64 m_bandRow;
+	QVector<Level> m_levels;
+	Node *m_root;
+	quint64 m_blocks, m_nodes;
 };
 
 HashLife::HashLife()
-	: m_readLock(new QMutex()), m_writeLock(new QMutex()), m_running(false),
-      m_blockHash(new HashTable<Block, uchar>()), m_nodeHash(new HashTable<Node, Node *>()),
-	  m_x(0), m_y(0), m_generation(0)
+	: m_writeLock(new QMutex()), m_running(false), m_rule(NULL),
+      m_blockHash(new HashTable<Block>()), m_nodeHash(new HashTable<Node>()),
+	  m_x(0), m_y(0), m_generation(0), m_increment(0), m_nextIncrement(0),
+	  m_hyperspeed(false), m_hyperspeedBudget(DEFAULT_HYPERSPEED_BUDGET), m_memoryLimit(DEFAULT_MEMORY_LIMIT),
+	  m_threadCount(QThread::idealThreadCount()), m_stepping(false), m_quitWorkers(false),
+	  m_cancelled(false), m_progressDepth(0), m_progressNodes(1), ms_w(0), ms_h(0)
 {
-	m_increment = 0; // TODO
-	Node *e = reinterpret_cast<Node *>(m_blockHash->get(0, 0, 0, 0));
+	Node *e = reinterpret_cast<Node *>(m_blockHash->get(0));
 	m_emptyNode.resize(Block::DEPTH + 1);
 	for (size_t i = 0; i < Block::DEPTH; i++)
 		m_emptyNode[i] = NULL;
@@ -182,11 +701,13 @@ HashLife::HashLife()
 	m_root = emptyNode(Block::DEPTH + 1);
 	m_depth = Block::DEPTH + 1;
 	expand(); // run() requires m_depth >= Block::DEPTH + 2
+	publish();
 }
 
 HashLife::~HashLife()
 {
-	delete m_readLock;
+	stopWorkers();
+	clearSnapshots();
 	delete m_writeLock;
 	delete m_blockHash;
 	delete m_nodeHash;
@@ -200,12 +721,22 @@ void HashLife::setReceiveRect(const BigInteger &x, const BigInteger &y, quint64
 	mc_h = h;
 }
 
+// Received cells are added to the universe, as in TreeLife
 void HashLife::receive(DataChannel *channel)
 {
-	//m_writeLock->lock();
-	//m_readLock->lock();
+	int state;
+	quint64 cnt;
+	// Dropped like setGrid(), but the sender still waits for its end
+	if (m_running)
+	{
+		while (channel->receive(&state, &cnt), state != DATACHANNEL_EOF)
+			;
+		return;
+	}
+	QTime timer;
+	timer.start();
+	m_writeLock->lock();
 	// out of range
-	// TODO: optimization
 	BigInteger x1 = mc_x - m_x, y1 = mc_y - m_y, x2 = x1 + BigInteger(mc_w - 1), y2 = y1 + BigInteger(mc_h - 1);
 	while (x1.sgn() < 0 || x2.sgn() < 0 || x2.bitCount() > m_depth || y1.sgn() < 0 || y2.sgn() < 0 || y2.bitCount() > m_depth)
 	{
@@ -215,26 +746,49 @@ void HashLife::receive(DataChannel *channel)
 		x2 = x1 + BigInteger(mc_w - 1);
 		y2 = y1 + BigInteger(mc_h - 1);
 	}
+	// The pattern is built as a tree of depth + 1 whose quadrants are aligned
+	// nodes of the universe, the upper left one holding (x1, y1)
+	size_t depth = Block::DEPTH;
+	while (depth < 62 && (Q_UINT64_C(1) << depth) < qMax(mc_w, mc_h))
+		depth++;
+	while (m_depth <= depth)
+		expand();
+	x1 = mc_x - m_x;
+	y1 = mc_y - m_y;
+	quint64 sx = x1.lowbits<quint64>(depth), sy = y1.lowbits<quint64>(depth);
+	BigInteger x0 = x1 - BigInteger(sx), y0 = y1 - BigInteger(sy);
+	emptyNode(depth + 1);
 
-	BigInteger x = mc_x, y = mc_y;
-	int state;
-	quint64 cnt;
+	HashLifeLoader loader(this, depth + 1);
+	quint64 x = sx, y = sy, cells = 0;
 	while (channel->receive(&state, &cnt), state != DATACHANNEL_EOF)
 	{
 		if (state == DATACHANNEL_EOLN)
 		{
-			x = mc_x;
+			x = sx;
 			y += cnt;
+			continue;
 		}
-		else
-			for (int i = 0; i < cnt; i++)
-			{
-				setGrid(x, y, state);
-				x += 1;
-			}
+		quint64 count = DataChannel::cellCount(state, cnt);
+		if (state == DATACHANNEL_BITS)
+			loader.addCells(x, y, DataChannel::cellBits(state, cnt, count), count);
+		else if (state)
+			loader.addRun(x, y, count);
+		x += count;
+		cells += count;
 	}
-	//m_readLock->unlock();
-	//m_writeLock->unlock();
+	Node *pattern = loader.finish();
+
+	BigInteger len = BigInteger::exp2(depth);
+	for (int i = 0; i < 4; i++)
+		if (pattern->child[i] != emptyNode(depth))
+			m_root = insertNode(m_root, m_depth, pattern->child[i], depth, (i & 1)? x0 + len: x0, (i & 2)? y0 + len: y0);
+	publish();
+	m_loadStatistics.cells = cells;
+	m_loadStatistics.blocks = loader.blocks();
+	m_loadStatistics.nodes = loader.nodes();
+	m_loadStatistics.loadTime = timer.elapsed();
+	m_writeLock->unlock();
 	emit gridChanged();
 }
 
@@ -264,16 +818,15 @@ void HashLife::setGrid(const BigInteger &x, const BigInteger &y, int state)
 		p = p->child[cid];
 	}
 	Block *block = reinterpret_cast<Block *>(p);
-	int cid = (my_y.lowbits<int>(Block::DEPTH) << 1) | my_x.lowbits<int>(Block::DEPTH);
-	if (block->child[cid] != state)
-	{
-		unsigned char c[4];
-		c[0] = block->child[0];
-		c[1] = block->child[1];
-		c[2] = block->child[2];
-		c[3] = block->child[3];
-		c[cid] = state;
-		p = reinterpret_cast<Node *>(m_blockHash->get(c[0], c[1], c[2], c[3]));
+	int bx = my_x.lowbits<int>(Block::DEPTH), by = my_y.lowbits<int>(Block::DEPTH);
+	if (block->get(bx, by) != (state > 0))
+	{
+		quint64 data = block->data;
+		if (state)
+			SET_BIT(data, by * Block::SIZE + bx);
+		else
+			CLR_BIT(data, by * Block::SIZE + bx);
+		p = reinterpret_cast<Node *>(m_blockHash->get(data));
 		while (depth++ < m_depth)
 		{
 			Node *c[4], *node = stack[depth];
@@ -286,27 +839,78 @@ void HashLife::setGrid(const BigInteger &x, const BigInteger &y, int state)
 		}
 		m_root = p;
 	}
-    delete stack;
-    delete cid_stack;
+	// An expanded universe is published as well
+	publish();
+    delete [] stack;
+    delete [] cid_stack;
 	m_writeLock->unlock();
 	emit gridChanged();
 }
 
 void HashLife::paint(CanvasPainter *painter, const BigInteger &x, const BigInteger &y, int w, int h, size_t scale)
 {
-	m_readLock->lock();
-	treePaint<HashLife, Block, Node>(this, painter, x, y, w, h, scale, m_x, m_y, m_depth, m_root, emptyNode(m_depth));
-	m_readLock->unlock();
+	int slot;
+	const Snapshot *snapshot = acquireSnapshot(&slot);
+	treePaint<HashLife, Block, Node>(this, painter, x, y, w, h, scale, snapshot->x, snapshot->y, snapshot->depth, static_cast<Node *>(snapshot->root), static_cast<Node *>(snapshot->emptyNode));
+	releaseSnapshot(slot);
+}
+
+bool HashLife::boundingRect(BigInteger *x, BigInteger *y, quint64 *w, quint64 *h)
+{
+	int slot;
+	const Snapshot *snapshot = acquireSendSnapshot(&slot);
+	bool ret = treeBoundingRect<HashLife, Block, Node>(this, x, y, w, h, snapshot->x, snapshot->y, snapshot->depth, static_cast<Node *>(snapshot->root));
+	releaseSnapshot(slot);
+	return ret;
+}
+
+void HashLife::setSendRect(const BigInteger &x, const BigInteger &y, quint64 w, quint64 h)
+{
+	ms_x = x;
+	ms_y = y;
+	ms_w = w;
+	ms_h = h;
+}
+
+// Only the nodes holding live cells are visited
+void HashLife::send(DataChannel *channel)
+{
+	int slot;
+	const Snapshot *snapshot = acquireSendSnapshot(&slot);
+	treeSend<HashLife, Block, Node>(this, channel, ms_x, ms_y, ms_w, ms_h, snapshot->x, snapshot->y, snapshot->depth, static_cast<Node *>(snapshot->root), static_cast<Node *>(snapshot->emptyNode));
+	releaseSnapshot(slot);
 }
 
 BigInteger HashLife::generation() const
 {
-	return m_generation;
+	int slot;
+	BigInteger ret = acquireSnapshot(&slot)->generation;
+	releaseSnapshot(slot);
+	return ret;
+}
+
+/// Sums up the children of the nodes of POPULATION_MAX, once per node
+static BigInteger nodePopulation(Node *node, QHash<Node *, BigInteger> &populations)
+{
+	if (node->population != POPULATION_MAX)
+		return BigInteger(node->population);
+	if (!populations.contains(node))
+	{
+		BigInteger ret;
+		for (int i = 0; i < 4; i++)
+			ret += nodePopulation(node->child[i], populations);
+		populations.insert(node, ret);
+	}
+	return populations.value(node);
 }
 
 BigInteger HashLife::population() const
 {
-	return 0;
+	int slot;
+	QHash<Node *, BigInteger> populations;
+	BigInteger ret = nodePopulation(static_cast<Node *>(acquireSnapshot(&slot)->root), populations);
+	releaseSnapshot(slot);
+	return ret;
 }
 
 Node *HashLife::emptyNode(size_t depth)
@@ -322,6 +926,19 @@ Node *HashLife::emptyNode(size_t depth)
 		return m_emptyNode[depth];
 }
 
+/// Makes the current universe the snapshot readers acquire
+void HashLife::publish()
+{
+	Snapshot *snapshot = new Snapshot();
+	snapshot->root = m_root;
+	snapshot->emptyNode = emptyNode(m_depth);
+	snapshot->depth = m_depth;
+	snapshot->x = m_x;
+	snapshot->y = m_y;
+	snapshot->generation = m_generation;
+	publishSnapshot(snapshot);
+}
+
 void HashLife::expand()
 {
 	Node *e = emptyNode(m_depth - 1);
@@ -336,20 +953,309 @@ void HashLife::expand()
 	m_depth++;
 }
 
-void HashLife::runStep()
+bool HashLife::readMacrocell(QIODevice *device, QString *rule)
 {
-	start();
+	m_writeLock->lock();
+	size_t depth;
+	BigInteger generation = 0;
+	Node *root = parseMacrocell(device, &depth, rule, &generation);
+	if (root)
+	{
+		// A lone block is put in the middle of a node, a quarter block off
+		if (depth == Block::DEPTH)
+		{
+			Node *e = emptyNode(Block::DEPTH);
+			root = m_nodeHash->get(e, e, e, root);
+			depth++;
+		}
+		m_root = root;
+		m_depth = depth;
+		m_x = m_y = BigInteger(0) - BigInteger::exp2(depth - 1);
+		m_generation = generation;
+		while (m_depth < Block::DEPTH + 2)
+			expand();
+		publish();
+	}
+	m_writeLock->unlock();
+	if (root)
+		emit gridChanged();
+	return root != NULL;
 }
 
-Node *HashLife::runNode(Node *node, size_t depth)
+/// The root of a macrocell file read into the hash tables, NULL if the file is invalid
+// Nodes come one per line after the [M2] header, children first. A block is
+// a line of rows of '.' and '*' ended by '$', other nodes are "depth ul ur
+// dl dr" with the line numbers of the children, 0 being the empty node.
+Node *HashLife::parseMacrocell(QIODevice *device, size_t *depth, QString *rule, BigInteger *generation)
 {
+	if (!device->readLine().startsWith("[M2]"))
+		return NULL;
+	QVector<Node *> nodes;
+	QVector<size_t> depths;
+	nodes.append(NULL);
+	depths.append(0);
+	while (!device->atEnd())
+	{
+		QByteArray line = device->readLine().trimmed();
+		if (line.isEmpty())
+			continue;
+		if (line[0] == '#')
+		{
+			if (line.startsWith("#R"))
+				*rule = QString(line.mid(2).trimmed());
+			else if (line.startsWith("#G"))
+				*generation = BigInteger(QString(line.mid(2).trimmed()));
+		}
+		else if (line[0] == '.' || line[0] == '*' || line[0] == '$')
+		{
+			quint64 data = 0;
+			size_t x = 0, y = 0;
+			for (int i = 0; i < line.size(); i++)
+			{
+				if (line[i] == '$')
+				{
+					x = 0;
+					y++;
+					continue;
+				}
+				if (x >= Block::SIZE || y >= Block::SIZE)
+					return NULL;
+				if (line[i] == '*')
+					SET_BIT(data, y * Block::SIZE + x);
+				x++;
+			}
+			nodes.append(reinterpret_cast<Node *>(m_blockHash->get(data)));
+			depths.append(Block::DEPTH);
+		}
+		else
+		{
+			QList<QByteArray> fields = line.split(' ');
+			bool ok;
+			size_t d = fields[0].toUInt(&ok);
+			if (!ok || d <= Block::DEPTH || fields.size() != 5)
+				return NULL;
+			Node *child[4];
+			for (int i = 0; i < 4; i++)
+			{
+				int id = fields[i + 1].toInt(&ok);
+				if (!ok || id < 0 || id >= nodes.size() || (id && depths[id] != d - 1))
+					return NULL;
+				child[i] = id? nodes[id]: emptyNode(d - 1);
+			}
+			nodes.append(m_nodeHash->get(child[0], child[1], child[2], child[3]));
+			depths.append(d);
+		}
+	}
+	if (nodes.size() == 1)
+		return NULL;
+	*depth = depths.last();
+	return nodes.last();
+}
+
+// Written from a snapshot as RLEFormat does, so steps go on meanwhile
+bool HashLife::writeMacrocell(QIODevice *device)
+{
+	int slot;
+	const Snapshot *snapshot = acquireSnapshot(&slot);
+	device->write("[M2] (KLife)\n");
+	if (m_rule)
+		device->write(("#R " + m_rule->string() + "\n").toAscii());
+	device->write(("#G " + static_cast<QString>(snapshot->generation) + "\n").toAscii());
+	QHash<Node *, int> ids;
+	// An empty universe still needs a node
+	if (writeMacrocellNode(device, static_cast<Node *>(snapshot->root), snapshot->depth, ids) == 0)
+	{
+		device->write(QByteArray::number(static_cast<uint>(snapshot->depth)));
+		device->write(" 0 0 0 0\n");
+	}
+	releaseSnapshot(slot);
+	return true;
+}
+
+/// Writes node after its children unless already written, returns its line number
+int HashLife::writeMacrocellNode(QIODevice *device, Node *node, size_t depth, QHash<Node *, int> &ids)
+{
+	// Not emptyNode(), which the step may be growing
+	if (!node->population)
+		return 0;
+	int id = ids.value(node);
+	if (id)
+		return id;
+	QByteArray line;
+	if (depth == Block::DEPTH)
+	{
+		// Dead cells ending a row and empty rows ending the block are left out
+		quint64 data = reinterpret_cast<Block *>(node)->data;
+		for (size_t y = 0; data; y++, data >>= Block::SIZE)
+		{
+			for (quint64 row = data & 0xFF; row; row >>= 1)
+				line += (row & 1)? '*': '.';
+			line += '$';
+		}
+	}
+	else
+	{
+		int child[4];
+		for (int i = 0; i < 4; i++)
+			child[i] = writeMacrocellNode(device, node->child[i], depth - 1, ids);
+		line = QByteArray::number(static_cast<uint>(depth));
+		for (int i = 0; i < 4; i++)
+		{
+			line += ' ';
+			line += QByteArray::number(child[i]);
+		}
+	}
+	line += '\n';
+	device->write(line);
+	id = ids.size() + 1;
+	ids.insert(node, id);
+	return id;
+}
+
+/// The union of the cells of two nodes of the given depth
+Node *HashLife::unionNode(Node *a, Node *b, size_t depth)
+{
+	Node *e = emptyNode(depth);
+	if (a == e || a == b)
+		return b;
+	if (b == e)
+		return a;
+	if (depth == Block::DEPTH)
+		return reinterpret_cast<Node *>(m_blockHash->get(reinterpret_cast<Block *>(a)->data | reinterpret_cast<Block *>(b)->data));
+	return m_nodeHash->get(unionNode(a->ul, b->ul, depth - 1), unionNode(a->ur, b->ur, depth - 1),
+						   unionNode(a->dl, b->dl, depth - 1), unionNode(a->dr, b->dr, depth - 1));
+}
+
+/// Adds the cells of sub, of depth subDepth and upper left corner (x, y) relative to node, to node
+Node *HashLife::insertNode(Node *node, size_t depth, Node *sub, size_t subDepth, const BigInteger &x, const BigInteger &y)
+{
+	if (depth == subDepth)
+		return unionNode(node, sub, depth);
+	Node *c[4] = {node->ul, node->ur, node->dl, node->dr};
+	int cid = (y.bit(depth - 1) << 1) | x.bit(depth - 1);
+	c[cid] = insertNode(c[cid], depth - 1, sub, subDepth, x, y);
+	return m_nodeHash->get(c[0], c[1], c[2], c[3]);
+}
+
+quint64 HashLife::memoryUsage() const
+{
+	return m_blockHash->memoryUsage() + m_nodeHash->memoryUsage();
+}
+
+void HashLife::setMemoryLimit(quint64 bytes)
+{
+	m_memoryLimit = bytes;
+}
+
+void HashLife::mark(Node *node, size_t depth, bool keepResults)
+{
+	if (depth == Block::DEPTH)
+	{
+		reinterpret_cast<Block *>(node)->marked = true;
+		return;
+	}
+	if (node->marked)
+		return;
+	node->marked = true;
+	mark(node->ul, depth - 1, keepResults);
+	mark(node->ur, depth - 1, keepResults);
+	mark(node->dl, depth - 1, keepResults);
+	mark(node->dr, depth - 1, keepResults);
 	if (node->result)
-		return node->result;
+	{
+		if (keepResults)
+			mark(node->result, depth - 1, true);
+		else
+			node->result = NULL;
+	}
+}
+
+void HashLife::collectGarbage(bool keepResults)
+{
+	for (int i = Block::DEPTH; i < m_emptyNode.size(); i++)
+		mark(m_emptyNode[i], i, keepResults);
+	// Readers may still be in the snapshots not deleted yet
+	foreach (Snapshot *snapshot, liveSnapshots())
+		mark(static_cast<Node *>(snapshot->root), snapshot->depth, keepResults);
+	mark(m_root, m_depth, keepResults);
+	m_blockHash->sweep();
+	m_nodeHash->sweep();
+}
+
+// Must be called with m_writeLock held
+void HashLife::collectGarbage()
+{
+	QTime timer;
+	timer.start();
+	quint64 nodesBefore = m_blockHash->size() + m_nodeHash->size();
+	quint64 bytesBefore = memoryUsage();
+	// Memoized results are the cheapest thing to lose, but also what makes
+	// HashLife fast. Keep them unless the reachable nodes alone are still too
+	// close to the limit, otherwise we would be collecting again next step.
+	collectGarbage(true);
+	if (memoryUsage() > m_memoryLimit / 2)
+		collectGarbage(false);
+	// The managers of the tables are idle between steps, unlike those of other threads
+	QList<MemoryManager *> managers;
+	m_blockHash->appendManagers(&managers);
+	m_nodeHash->appendManagers(&managers);
+	MemoryManager::releaseMemory(managers);
+	m_gcStatistics.collections++;
+	m_gcStatistics.nodesBefore = nodesBefore;
+	m_gcStatistics.nodesAfter = m_blockHash->size() + m_nodeHash->size();
+	m_gcStatistics.bytesFreed = bytesBefore - memoryUsage();
+	m_gcStatistics.pauseTime = timer.elapsed();
+}
+
+void HashLife::setStepExponent(size_t exponent)
+{
+	m_nextIncrement = exponent;
+}
+
+void HashLife::setHyperspeed(bool hyperspeed)
+{
+	m_hyperspeed = hyperspeed;
+}
+
+void HashLife::setHyperspeedBudget(int msecs)
+{
+	m_hyperspeedBudget = msecs;
+}
+
+void HashLife::setRule(Rule *rule)
+{
+	m_writeLock->lock();
+	m_rule = reinterpret_cast<RuleLife *>(rule);
+	// Every memoized result was computed with the old rule
+	m_nodeHash->clearResults();
+	m_writeLock->unlock();
+}
+
+// Returns NULL once the step is cancelled. Only finished results are
+// memoized, so the nodes left are computed again by the next step.
+Node *HashLife::runNode(Node *node, size_t depth, int worker)
+{
+	// Nodes lower than m_increment + 2 go 2^(depth - 2) generations ahead
+	const int nodeStep = static_cast<int>(qMin(m_increment, depth - 2));
+	Node *cached = node->cachedResult(nodeStep);
+	if (cached)
+	{
+		// The nodes of m_progressDepth it would have run count as done
+		if (depth == m_progressDepth + 1)
+			m_progressDone.fetchAndAddRelaxed(m_increment + 2 < depth? 9: 13);
+		else if (depth == m_progressDepth + 2)
+			m_progressDone.fetchAndAddRelaxed(m_progressNodes);
+		return cached;
+	}
+	if (m_cancelled)
+		return NULL;
+	nodeComputed(worker);
 	if (depth == Block::DEPTH + 1)
 	{
-        uchar nul, nur, ndl, ndr;
-		Block::runStep(AlgorithmManager::rule(), nul, nur, ndl, ndr, reinterpret_cast<Block *>(node->ul), reinterpret_cast<Block *>(node->ur), reinterpret_cast<Block *>(node->dl), reinterpret_cast<Block *>(node->dr));
-		return node->result = reinterpret_cast<Node *>(m_blockHash->get(nul, nur, ndl, ndr));
+		quint64 data = Block::runStep(m_rule, nodeStep,
+				reinterpret_cast<Block *>(node->ul)->data, reinterpret_cast<Block *>(node->ur)->data,
+				reinterpret_cast<Block *>(node->dl)->data, reinterpret_cast<Block *>(node->dr)->data);
+		return node->setResult(reinterpret_cast<Node *>(m_blockHash->get(data)), nodeStep);
 	}
 	else
 	{
@@ -363,15 +1269,20 @@ Node *HashLife::runNode(Node *node, size_t depth)
 		// 0 g g h h i i 0
 		// 0 0 0 0 0 0 0 0
 		// 1. Calculate 9 sub-nodes
-		Node *a = runNode(node->ul, depth - 1);
-		Node *b = runNode(m_nodeHash->get(node->ul->ur, node->ur->ul, node->ul->dr, node->ur->dl), depth - 1);
-		Node *c = runNode(node->ur, depth - 1);
-		Node *d = runNode(m_nodeHash->get(node->ul->dl, node->ul->dr, node->dl->ul, node->dl->ur), depth - 1);
-		Node *e = runNode(m_nodeHash->get(node->ul->dr, node->ur->dl, node->dl->ur, node->dr->ul), depth - 1);
-		Node *f = runNode(m_nodeHash->get(node->ur->dl, node->ur->dr, node->dr->ul, node->dr->ur), depth - 1);
-		Node *g = runNode(node->dl, depth - 1);
-		Node *h = runNode(m_nodeHash->get(node->dl->ur, node->dr->ul, node->dl->dr, node->dr->dl), depth - 1);
-		Node *i = runNode(node->dr, depth - 1);
+		Node *sub[9];
+		sub[0] = node->ul;
+		sub[1] = m_nodeHash->get(node->ul->ur, node->ur->ul, node->ul->dr, node->ur->dl);
+		sub[2] = node->ur;
+		sub[3] = m_nodeHash->get(node->ul->dl, node->ul->dr, node->dl->ul, node->dl->ur);
+		sub[4] = m_nodeHash->get(node->ul->dr, node->ur->dl, node->dl->ur, node->dr->ul);
+		sub[5] = m_nodeHash->get(node->ur->dl, node->ur->dr, node->dr->ul, node->dr->ur);
+		sub[6] = node->dl;
+		sub[7] = m_nodeHash->get(node->dl->ur, node->dr->ul, node->dl->dr, node->dr->dl);
+		sub[8] = node->dr;
+		runNodes(sub, 9, depth - 1, worker);
+		if (m_cancelled)
+			return NULL;
+		Node *a = sub[0], *b = sub[1], *c = sub[2], *d = sub[3], *e = sub[4], *f = sub[5], *g = sub[6], *h = sub[7], *i = sub[8];
 		if (m_increment + 2 < depth) // no need to do more increment
 		{
 			if (depth == Block::DEPTH + 2) // 9 sub-nodes are actually blocks
@@ -385,36 +1296,240 @@ Node *HashLife::runNode(Node *node, size_t depth)
 				Block *G = reinterpret_cast<Block *>(g);
 				Block *H = reinterpret_cast<Block *>(h);
 				Block *I = reinterpret_cast<Block *>(i);
-				Node *nul = reinterpret_cast<Node *>(m_blockHash->get(A->dr, B->dl, D->ur, E->ul));
-				Node *nur = reinterpret_cast<Node *>(m_blockHash->get(B->dr, C->dl, E->ur, F->ul));
-				Node *ndl = reinterpret_cast<Node *>(m_blockHash->get(D->dr, E->dl, G->ur, H->ul));
-				Node *ndr = reinterpret_cast<Node *>(m_blockHash->get(E->dr, F->dl, H->ur, I->ul));
-				return node->result = m_nodeHash->get(nul, nur, ndl, ndr);
+				Node *nul = reinterpret_cast<Node *>(m_blockHash->get(Block::centre(A->data, B->data, D->data, E->data)));
+				Node *nur = reinterpret_cast<Node *>(m_blockHash->get(Block::centre(B->data, C->data, E->data, F->data)));
+				Node *ndl = reinterpret_cast<Node *>(m_blockHash->get(Block::centre(D->data, E->data, G->data, H->data)));
+				Node *ndr = reinterpret_cast<Node *>(m_blockHash->get(Block::centre(E->data, F->data, H->data, I->data)));
+				return node->setResult(m_nodeHash->get(nul, nur, ndl, ndr), nodeStep);
 			}
 			Node *nul = m_nodeHash->get(a->dr, b->dl, d->ur, e->ul);
 			Node *nur = m_nodeHash->get(b->dr, c->dl, e->ur, f->ul);
 			Node *ndl = m_nodeHash->get(d->dr, e->dl, g->ur, h->ul);
 			Node *ndr = m_nodeHash->get(e->dr, f->dl, h->ur, i->ul);
-			return node->result = m_nodeHash->get(nul, nur, ndl, ndr);
+			return node->setResult(m_nodeHash->get(nul, nur, ndl, ndr), nodeStep);
 		}
 		// else use the full increment power
 		// 2. Calculate final RESULT
-		Node *nul = runNode(m_nodeHash->get(a, b, d, e), depth - 1);
-		Node *nur = runNode(m_nodeHash->get(b, c, e, f), depth - 1);
-		Node *ndl = runNode(m_nodeHash->get(d, e, g, h), depth - 1);
-		Node *ndr = runNode(m_nodeHash->get(e, f, h, i), depth - 1);
-		return node->result = m_nodeHash->get(nul, nur, ndl, ndr);
+		Node *next[4];
+		next[0] = m_nodeHash->get(a, b, d, e);
+		next[1] = m_nodeHash->get(b, c, e, f);
+		next[2] = m_nodeHash->get(d, e, g, h);
+		next[3] = m_nodeHash->get(e, f, h, i);
+		runNodes(next, 4, depth - 1, worker);
+		if (m_cancelled)
+			return NULL;
+		return node->setResult(m_nodeHash->get(next[0], next[1], next[2], next[3]), nodeStep);
 	}
 }
 
-#include <QTime>
-void HashLife::run()
+// Replaces every node by its result.
+// worker is the index of the calling thread in m_jobQueues, or -1 when the
+// step runs on a single thread. Above the depth cutoff all nodes but the
+// first are pushed to the queue of the calling thread where idle threads can
+// steal them, and the first one is computed directly.
+// Results may be computed twice when two threads meet the same node, but
+// both get the same canonical node so the memoization stays consistent.
+inline void HashLife::runNodes(Node **nodes, int count, size_t depth, int worker)
+{
+	if (worker < 0 || depth < Block::DEPTH + PARALLEL_DEPTH)
+	{
+		for (int i = 0; i < count; i++)
+			nodes[i] = runNode(nodes[i], depth, worker);
+		if (depth == m_progressDepth)
+			m_progressDone.fetchAndAddRelaxed(count);
+		return;
+	}
+	RunNodeJob jobs[9];
+	JobQueue *queue = m_jobQueues[worker];
+	queue->mutex.lock();
+	for (int i = 1; i < count; i++)
+	{
+		jobs[i].node = nodes[i];
+		jobs[i].depth = depth;
+		jobs[i].done = 0;
+		queue->jobs.append(&jobs[i]);
+	}
+	queue->mutex.unlock();
+	m_pendingJobs.fetchAndAddOrdered(count - 1);
+	wakeIdleThreads();
+	nodes[0] = runNode(nodes[0], depth, worker);
+	for (int i = count - 1; i > 0; i--)
+	{
+		// Instead of waiting idly, keep working on other jobs. Most of the
+		// time this job is still at the back of our own queue and gets
+		// executed by ourselves right away.
+		while (!jobs[i].done.fetchAndAddAcquire(0))
+		{
+			RunNodeJob *job = takeJob(worker);
+			if (job)
+				executeJob(job, worker);
+			else
+				waitForJob(&jobs[i].done);
+		}
+		nodes[i] = jobs[i].result;
+	}
+	if (depth == m_progressDepth)
+		m_progressDone.fetchAndAddRelaxed(count);
+}
+
+inline void HashLife::nodeComputed(int worker)
+{
+	// Single threaded steps count in the queue of the first worker as well
+	JobQueue *queue = m_jobQueues[qMax(worker, 0)];
+	if (++queue->computed % PROGRESS_NODES)
+		return;
+	queue->mutex.lock();
+	queue->reported = queue->computed;
+	queue->mutex.unlock();
+	// The thread of the step reports for all of them
+	if (worker <= 0 && m_progressTimer.elapsed() >= PROGRESS_INTERVAL)
+	{
+		m_progressTimer.restart();
+		reportProgress();
+	}
+}
+
+void HashLife::reportProgress()
+{
+	quint64 computed = 0;
+	foreach (JobQueue *queue, m_jobQueues)
+	{
+		queue->mutex.lock();
+		computed += queue->reported;
+		queue->mutex.unlock();
+	}
+	emit stepProgress(computed, qMin(static_cast<double>(m_progressDone) / m_progressNodes, 1.0));
+}
+
+void HashLife::cancelStep()
+{
+	if (m_running)
+		m_cancelled = true;
+}
+
+RunNodeJob *HashLife::takeJob(int worker)
+{
+	RunNodeJob *job = NULL;
+	JobQueue *queue = m_jobQueues[worker];
+	queue->mutex.lock();
+	if (!queue->jobs.isEmpty())
+		job = queue->jobs.takeLast();
+	queue->mutex.unlock();
+	for (int i = 1; !job && i < m_jobQueues.size(); i++)
+	{
+		queue = m_jobQueues[(worker + i) % m_jobQueues.size()];
+		queue->mutex.lock();
+		if (!queue->jobs.isEmpty())
+			job = queue->jobs.takeFirst();
+		queue->mutex.unlock();
+	}
+	if (job)
+		m_pendingJobs.fetchAndAddOrdered(-1);
+	return job;
+}
+
+void HashLife::executeJob(RunNodeJob *job, int worker)
+{
+	job->result = runNode(job->node, job->depth, worker);
+	// The owner of the job may return as soon as it sees this
+	job->done.fetchAndStoreOrdered(1);
+	wakeIdleThreads();
+}
+
+// Parks the calling thread until a job is pushed, or until done is set if
+// given, otherwise until the step is over
+void HashLife::waitForJob(QAtomicInt *done)
+{
+	m_workerMutex.lock();
+	// Whoever pushes a job or sets done after we look sees us idle and wakes us
+	m_idleThreads.fetchAndAddOrdered(1);
+	while (!m_pendingJobs.fetchAndAddOrdered(0)
+		&& (done? !done->fetchAndAddOrdered(0): m_stepping && !m_quitWorkers))
+		m_workerCondition.wait(&m_workerMutex);
+	m_idleThreads.fetchAndAddOrdered(-1);
+	m_workerMutex.unlock();
+}
+
+void HashLife::wakeIdleThreads()
+{
+	if (!m_idleThreads.fetchAndAddOrdered(0))
+		return;
+	m_workerMutex.lock();
+	m_workerCondition.wakeAll();
+	m_workerMutex.unlock();
+}
+
+void HashLife::workerRun(int worker)
+{
+	forever
+	{
+		if (!m_stepping)
+		{
+			m_workerMutex.lock();
+			while (!m_stepping && !m_quitWorkers)
+				m_workerCondition.wait(&m_workerMutex);
+			bool quit = m_quitWorkers;
+			m_workerMutex.unlock();
+			if (quit)
+				return;
+		}
+		RunNodeJob *job = takeJob(worker);
+		if (job)
+			executeJob(job, worker);
+		else
+			waitForJob(NULL);
+	}
+}
+
+void HashLife::setThreadCount(int count)
+{
+	m_threadCount = qMax(count, 1);
+}
+
+// Called from run(), so no step is in progress
+void HashLife::startWorkers()
+{
+	if (m_jobQueues.size() == m_threadCount)
+		return;
+	stopWorkers();
+	for (int i = 0; i < m_threadCount; i++)
+		m_jobQueues.append(new JobQueue());
+	// run() itself works as the first thread
+	for (int i = 1; i < m_threadCount; i++)
+	{
+		HashLifeWorker *worker = new HashLifeWorker(this, i);
+		m_workers.append(worker);
+		worker->start();
+	}
+}
+
+void HashLife::stopWorkers()
+{
+	m_workerMutex.lock();
+	m_quitWorkers = true;
+	m_workerCondition.wakeAll();
+	m_workerMutex.unlock();
+	foreach (HashLifeWorker *worker, m_workers)
+	{
+		worker->wait();
+		delete worker;
+	}
+	m_workers.clear();
+	foreach (JobQueue *queue, m_jobQueues)
+		delete queue;
+	m_jobQueues.clear();
+	m_quitWorkers = false;
+}
+
+void HashLife::step()
 {
 	QTime timer;
 	timer.start();
+	m_cancelled = false;
 	m_running = true;
 	m_writeLock->lock();
-	m_readLock->lock();
+	// The memoized results are kept along with their step, see Node::cachedResult()
+	m_increment = m_nextIncrement;
 	while (m_increment + 2 > m_depth)
 		expand();
 	Node *e = emptyNode(m_depth - 2);
@@ -433,14 +1548,37 @@ void HashLife::run()
 	Node *ndl = m_nodeHash->get(e, m_root->dl, e, e);
 	Node *ndr = m_nodeHash->get(m_root->dr, e, e, e);
 	Node *nroot = m_nodeHash->get(nul, nur, ndl, ndr);
-	m_readLock->unlock();
-	Node *new_root = runNode(nroot, m_depth + 1);
-	m_readLock->lock();
-	m_root = new_root;
-	m_readLock->unlock();
+	startWorkers();
+	// Every node runs 9 or 13 nodes a level below, and the grandchildren of
+	// the root, being many and alike, tell how far the step has come
+	m_progressDepth = m_depth - 1;
+	m_progressNodes = (m_increment + 2 < m_depth + 1? 9: 13) * (m_increment + 2 < m_depth? 9: 13);
+	m_progressDone = 0;
+	foreach (JobQueue *queue, m_jobQueues)
+		queue->computed = queue->reported = 0;
+	m_progressTimer.start();
+	if (m_threadCount > 1)
+	{
+		m_workerMutex.lock();
+		m_stepping = true;
+		m_workerCondition.wakeAll();
+		m_workerMutex.unlock();
+	}
+	Node *new_root = runNode(nroot, m_depth + 1, m_threadCount > 1? 0: -1);
+	m_stepping = false;
+	// A cancelled step leaves the universe as it was
+	if (new_root)
+	{
+		m_root = new_root;
+		m_generation += BigInteger::exp2(m_increment);
+		publish();
+	}
+	if (m_memoryLimit && memoryUsage() > m_memoryLimit)
+		collectGarbage();
+	int elapsed = timer.elapsed();
+	// Only raise the step when nobody asked for another one in the meantime
+	if (new_root && m_hyperspeed && elapsed < m_hyperspeedBudget && m_nextIncrement == m_increment)
+		m_nextIncrement = m_increment + 1;
 	m_writeLock->unlock();
-	m_generation += BigInteger::exp2(m_increment);
 	m_running = false;
-	emit gridChanged();
-	qDebug() << timer.elapsed();
 }
@@ -20,63 +20,181 @@
 #ifndef HASHLIFE_H
 #define HASHLIFE_H
 
+#include <QAtomicInt>
+#include <QHash>
+#include <QMutex>
+#include <QTime>
 #include <QVector>
+#include <QWaitCondition>
 
 #include "AbstractAlgorithm.h"
 #include "BigInteger.h"
-#include "MemoryManager.h"
 #include "Rule.h"
 
-struct Block;
-struct Node;
-template <typename T, typename subtype> class HashTable;
-class QMutex;
-class HashLife: public AbstractAlgorithm, private MemoryManager
+struct RunNodeJob;
+struct JobQueue;
+template <typename T> class HashTable;
+class HashLifeLoader;
+class HashLifeWorker;
+class QIODevice;
+class RuleLife;
+class HashLife: public AbstractAlgorithm
 {
 	Q_OBJECT
 
 public:
+	// Defined in HashLife.cpp, nested as TreeLife has its own Block and Node
+	struct Block;
+	struct Node;
+
 	HashLife();
 	virtual ~HashLife();
 
 	virtual QString name() { return "HashLife"; }
 	virtual bool acceptRule(Rule *rule) { return rule->type() == Rule::Life; }
+	virtual void setRule(Rule *rule);
 
 	virtual void setReceiveRect(const BigInteger &x, const BigInteger &y, quint64 w, quint64 h);
 	virtual void receive(DataChannel *channel);
+	virtual bool boundingRect(BigInteger *x, BigInteger *y, quint64 *w, quint64 *h);
+	virtual void setSendRect(const BigInteger &x, const BigInteger &y, quint64 w, quint64 h);
+	virtual void send(DataChannel *channel);
 	virtual int grid(const BigInteger &x, const BigInteger &y) { Q_UNUSED(x); Q_UNUSED(y); return 0; } // TODO: Who use this now?
 	virtual void setGrid(const BigInteger &x, const BigInteger &y, int state);
 	virtual void clearGrid() {}
 	virtual BigInteger generation() const;
 	virtual BigInteger population() const;
 	virtual void paint(CanvasPainter *painter, const BigInteger &x, const BigInteger &y, int w, int h, size_t scale);
-	virtual void runStep();
+	/// A step advances 2^stepExponent() generations
+	virtual size_t stepExponent() const { return m_nextIncrement; }
+	/// Takes effect from the next step
+	virtual void setStepExponent(size_t exponent);
+	virtual bool isHyperspeed() const { return m_hyperspeed; }
+	/// In hyperspeed mode the step exponent is increased after every step faster than hyperspeedBudget()
+	virtual void setHyperspeed(bool hyperspeed);
+	int hyperspeedBudget() const { return m_hyperspeedBudget; }
+	void setHyperspeedBudget(int msecs);
+	virtual int threadCount() const { return m_threadCount; }
+	/// Takes effect from the next step
+	virtual void setThreadCount(int count);
+	/// The results computed before the step is cancelled are kept for the next one
+	virtual void cancelStep();
+
+	struct GCStatistics
+	{
+		GCStatistics(): collections(0), nodesBefore(0), nodesAfter(0), bytesFreed(0), pauseTime(0) {}
+
+		int collections;
+		quint64 nodesBefore, nodesAfter; // Of the last collection
+		quint64 bytesFreed;
+		int pauseTime; // In milliseconds
+	};
+
+	/// Bytes used by nodes, blocks and the hash tables
+	quint64 memoryUsage() const;
+	quint64 memoryLimit() const { return m_memoryLimit; }
+	/// Garbage is collected after a step once memoryUsage() exceeds the limit, 0 means no limit
+	void setMemoryLimit(quint64 bytes);
+	const GCStatistics &gcStatistics() const { return m_gcStatistics; }
+
+	struct LoadStatistics
+	{
+		LoadStatistics(): cells(0), blocks(0), nodes(0), loadTime(0) {}
+
+		// Of the last receive()
+		quint64 cells; // Received, dead ones included
+		quint64 blocks, nodes; // Built for the received pattern
+		int loadTime; // In milliseconds
+	};
+
+	const LoadStatistics &loadStatistics() const { return m_loadStatistics; }
+
+	/// Replaces the universe by the one of a macrocell file, rule holds its rule if any
+	bool readMacrocell(QIODevice *device, QString *rule);
+	/// Writes every canonical node of the universe once
+	bool writeMacrocell(QIODevice *device);
 
 private:
-	virtual void run();
+	static const quint64 DEFAULT_MEMORY_LIMIT = Q_UINT64_C(1) << 30;
+	static const int DEFAULT_HYPERSPEED_BUDGET = 100;
+	// Only nodes at least this many levels above the blocks are worth running on another thread
+	static const size_t PARALLEL_DEPTH = 8;
+	// The progress of a step is reported every PROGRESS_INTERVAL milliseconds at most,
+	// the time being looked at once every PROGRESS_NODES nodes computed
+	static const int PROGRESS_INTERVAL = 250;
+	static const quint64 PROGRESS_NODES = 1 << 16;
+
+	virtual void step();
 	void rectChange(const BigInteger &x, const BigInteger &y, const BigInteger &w, const BigInteger &h) {}
 	Node *emptyNode(size_t depth);
+	void publish();
 	void expand();
-	Node *runNode(Node *node, size_t depth);
+	Node *parseMacrocell(QIODevice *device, size_t *depth, QString *rule, BigInteger *generation);
+	int writeMacrocellNode(QIODevice *device, Node *node, size_t depth, QHash<Node *, int> &ids);
+	Node *unionNode(Node *a, Node *b, size_t depth);
+	Node *insertNode(Node *node, size_t depth, Node *sub, size_t subDepth, const BigInteger &x, const BigInteger &y);
+	Node *runNode(Node *node, size_t depth, int worker);
+	inline void runNodes(Node **nodes, int count, size_t depth, int worker);
+	inline void nodeComputed(int worker);
+	void reportProgress();
+	RunNodeJob *takeJob(int worker);
+	void executeJob(RunNodeJob *job, int worker);
+	void waitForJob(QAtomicInt *done);
+	void wakeIdleThreads();
+	void workerRun(int worker);
+	void startWorkers();
+	void stopWorkers();
+	void mark(Node *node, size_t depth, bool keepResults);
+	void collectGarbage(bool keepResults);
+	void collectGarbage();
 
-	QMutex *m_readLock, *m_writeLock;
+	QMutex *m_writeLock;
 	volatile bool m_running;
+	RuleLife *m_rule;
 
-    HashTable<Block, uchar> *m_blockHash;
-    HashTable<Node, Node *> *m_nodeHash;
+    HashTable<Block> *m_blockHash;
+    HashTable<Node> *m_nodeHash;
 	Node *m_root;
 	size_t m_depth;
 	QVector<Node *> m_emptyNode;
 
 	BigInteger m_x, m_y;
 	BigInteger m_generation;
-	size_t m_increment;
+	size_t m_increment, m_nextIncrement;
+	bool m_hyperspeed;
+	int m_hyperspeedBudget;
+
+	quint64 m_memoryLimit;
+	GCStatistics m_gcStatistics;
+	LoadStatistics m_loadStatistics;
+
+	// Parallel step related
+	int m_threadCount;
+	QVector<HashLifeWorker *> m_workers;
+	QVector<JobQueue *> m_jobQueues;
+	QMutex m_workerMutex;
+	QWaitCondition m_workerCondition;
+	volatile bool m_stepping, m_quitWorkers;
+	// Jobs in the queues, and threads parked in waitForJob()
+	QAtomicInt m_pendingJobs, m_idleThreads;
+
+	// Progress related
+	volatile bool m_cancelled;
+	QTime m_progressTimer;
+	// The part done is estimated from the nodes of m_progressDepth run or skipped
+	// through a memoized parent, out of m_progressNodes
+	size_t m_progressDepth;
+	QAtomicInt m_progressDone;
+	int m_progressNodes;
 
 	// DataChannel related
 	BigInteger mc_x, mc_y;
 	quint64 mc_w, mc_h;
+	BigInteger ms_x, ms_y;
+	quint64 ms_w, ms_h;
 
-	friend class Node;
+	friend class HashLifeLoader;
+	friend class HashLifeWorker;
 };
 
 #endif
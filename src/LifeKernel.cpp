@@ -0,0 +1,93 @@
+/*
+ *   Copyright (C) 2012 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIFEKERNEL_X86
+// Every function taking or returning vectors is inlined, so the ABI they
+// would have otherwise does not matter
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+#include "LifeKernel.h"
+
+typedef void (*StepBlocksFunction)(const RuleLife *rule, int count, const quint64 in[9][BLOCK_LANES], quint64 *out);
+
+static void stepBlocksGeneric(const RuleLife *rule, int count, const quint64 in[9][BLOCK_LANES], quint64 *out)
+{
+	for (int i = 0; i < count; i++)
+		out[i] = stepBlock<quint64>(rule, in[0][i], in[1][i], in[2][i], in[3][i], in[4][i], in[5][i], in[6][i], in[7][i], in[8][i]);
+}
+
+#ifdef LIFEKERNEL_X86
+typedef quint64 Vector2 __attribute__((vector_size(16)));
+typedef quint64 Vector4 __attribute__((vector_size(32)));
+
+template <typename V>
+ALWAYS_INLINE V load(const quint64 *p)
+{
+	V ret;
+	memcpy(&ret, p, sizeof(V));
+	return ret;
+}
+
+template <typename V>
+ALWAYS_INLINE void stepVector(const RuleLife *rule, int offset, const quint64 in[9][BLOCK_LANES], quint64 *out)
+{
+	V ret = stepBlock<V>(rule, load<V>(in[0] + offset), load<V>(in[1] + offset), load<V>(in[2] + offset),
+			load<V>(in[3] + offset), load<V>(in[4] + offset), load<V>(in[5] + offset),
+			load<V>(in[6] + offset), load<V>(in[7] + offset), load<V>(in[8] + offset));
+	memcpy(out + offset, &ret, sizeof(V));
+}
+
+// Unused lanes are computed too, out must have room for BLOCK_LANES blocks
+static void stepBlocksSse2(const RuleLife *rule, int count, const quint64 in[9][BLOCK_LANES], quint64 *out)
+{
+	stepVector<Vector2>(rule, 0, in, out);
+	if (count > 2)
+		stepVector<Vector2>(rule, 2, in, out);
+}
+
+__attribute__((target("avx2")))
+static void stepBlocksAvx2(const RuleLife *rule, int count, const quint64 in[9][BLOCK_LANES], quint64 *out)
+{
+	Q_UNUSED(count);
+	stepVector<Vector4>(rule, 0, in, out);
+}
+#endif
+
+static StepBlocksFunction selectStepBlocks()
+{
+#ifdef LIFEKERNEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return stepBlocksAvx2;
+	if (__builtin_cpu_supports("sse2"))
+		return stepBlocksSse2;
+#endif
+	return stepBlocksGeneric;
+}
+
+static const StepBlocksFunction stepBlocksFunction = selectStepBlocks();
+
+void stepBlocks(const RuleLife *rule, int count, const quint64 in[9][BLOCK_LANES], quint64 *out)
+{
+	stepBlocksFunction(rule, count, in, out);
+}
@@ -0,0 +1,106 @@
+/*
+ *   Copyright (C) 2012 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef LIFEKERNEL_H
+#define LIFEKERNEL_H
+
+#include "RuleLife.h"
+#include "Utils.h"
+
+// Bit-sliced kernels for 8x8 blocks stored in a quint64, cell (x, y) being bit y * 8 + x
+// The templates work on quint64 as well as on GCC vector types holding
+// several blocks, so the same code serves the scalar and the SIMD paths.
+
+/// The number of blocks stepBlocks() handles in one call
+static const int BLOCK_LANES = 4;
+
+/// Adds a, b and c bitwise, giving the sum and carry bits
+template <typename W>
+ALWAYS_INLINE void fullAdd(W &sum, W &carry, W a, W b, W c)
+{
+	W t = a ^ b;
+	sum = t ^ c;
+	carry = (a & b) | (t & c);
+}
+
+/// Adds up 8 bitmaps with a tree of full adders, giving the 4 bit planes of the count
+template <typename W>
+ALWAYS_INLINE void countNeighbours(W *count, W n0, W n1, W n2, W n3, W n4, W n5, W n6, W n7)
+{
+	W s0, c0, s1, c1, c3, c4, t;
+	fullAdd(s0, c0, n0, n1, n2);
+	fullAdd(s1, c1, n3, n4, n5);
+	// Weight 1
+	fullAdd(count[0], c3, s0, s1, n6 ^ n7);
+	// Weight 2: c0, c1, n6 & n7 and c3
+	fullAdd(t, c4, c0, c1, n6 & n7);
+	count[1] = t ^ c3;
+	t = t & c3;
+	// Weight 4: c4 and t, both set only when all 8 neighbours are
+	count[2] = c4 ^ t;
+	count[3] = c4 & t;
+}
+
+/// Cell (x, y) of the result is cell (x, y - 1) of block, taking row -1 from up
+template <typename W>
+ALWAYS_INLINE W shiftDown(W block, W up)
+{
+	return (block << 8) | (up >> 56);
+}
+
+/// Cell (x, y) of the result is cell (x, y + 1) of block, taking row 8 from down
+template <typename W>
+ALWAYS_INLINE W shiftUp(W block, W down)
+{
+	return (block >> 8) | (down << 56);
+}
+
+/// Cell (x, y) of the result is cell (x - 1, y) of block, taking column -1 from left
+template <typename W>
+ALWAYS_INLINE W shiftRight(W block, W left)
+{
+	return ((block << 1) & Q_UINT64_C(0xFEFEFEFEFEFEFEFE)) | ((left >> 7) & Q_UINT64_C(0x0101010101010101));
+}
+
+/// Cell (x, y) of the result is cell (x + 1, y) of block, taking column 8 from right
+template <typename W>
+ALWAYS_INLINE W shiftLeft(W block, W right)
+{
+	return ((block >> 1) & Q_UINT64_C(0x7F7F7F7F7F7F7F7F)) | ((right << 7) & Q_UINT64_C(0x8080808080808080));
+}
+
+/// Computes the next generation of block from it and its 8 neighbour blocks
+template <typename W>
+ALWAYS_INLINE W stepBlock(const RuleLife *rule, W block, W up, W down, W left, W right, W upleft, W upright, W downleft, W downright)
+{
+	W above = shiftDown(block, up), below = shiftUp(block, down);
+	W count[4];
+	countNeighbours(count,
+			shiftRight(above, shiftDown(left, upleft)), above, shiftLeft(above, shiftDown(right, upright)),
+			shiftRight(block, left), shiftLeft(block, right),
+			shiftRight(below, shiftUp(left, downleft)), below, shiftLeft(below, shiftUp(right, downright)));
+	return rule->nextStates(block, count[0], count[1], count[2], count[3]);
+}
+
+/// Steps count (at most BLOCK_LANES) blocks at once
+// in[k][i] is neighbour k of block i, in the order of the stepBlock() parameters.
+// Uses AVX2 or SSE2 when the processor supports them.
+extern void stepBlocks(const RuleLife *rule, int count, const quint64 in[9][BLOCK_LANES], quint64 *out);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ *   Copyright (C) 2011 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "AlgorithmManager.h"
+#include "FileFormatManager.h"
+#include "HashLife.h"
+#include "MacrocellFormat.h"
+#include "RuleLife.h"
+
+REGISTER_FILEFORMAT(MacrocellFormat)
+
+QString MacrocellFormat::formatName() const
+{
+	return "Macrocell";
+}
+
+QList<QString> MacrocellFormat::supportedFormats() const
+{
+	return QList<QString>() << "mc";
+}
+
+bool MacrocellFormat::acceptAlgorithm(AbstractAlgorithm *algorithm) const
+{
+	return qobject_cast<HashLife *>(algorithm) != NULL;
+}
+
+bool MacrocellFormat::readDevice(QIODevice *device, AbstractAlgorithm *algorithm)
+{
+	HashLife *hashLife = qobject_cast<HashLife *>(algorithm);
+	if (!hashLife)
+		return false;
+	QString rule;
+	if (!hashLife->readMacrocell(device, &rule))
+		return false;
+	RuleLife *ruleLife = RuleLife::fromString(rule);
+	if (ruleLife && ruleLife->string() != AlgorithmManager::rule()->string())
+		AlgorithmManager::setRule(ruleLife);
+	else
+		delete ruleLife;
+	return true;
+}
+
+bool MacrocellFormat::writeDevice(QIODevice *device, AbstractAlgorithm *algorithm)
+{
+	HashLife *hashLife = qobject_cast<HashLife *>(algorithm);
+	if (!hashLife)
+		return false;
+	return hashLife->writeMacrocell(device);
+}
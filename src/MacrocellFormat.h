@@ -0,0 +1,38 @@
+/*
+ *   Copyright (C) 2011 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef MACROCELLFORMAT_H
+#define MACROCELLFORMAT_H
+
+#include "AbstractFileFormat.h"
+
+/// The macrocell format of Golly, a file line per canonical node
+// Only HashLife keeps its universe as canonical nodes, so only it can read
+// and write this format.
+class MacrocellFormat: public AbstractFileFormat
+{
+public:
+	virtual QString formatName() const;
+	virtual QList<QString> supportedFormats() const;
+	virtual bool acceptAlgorithm(AbstractAlgorithm *algorithm) const;
+	virtual bool readDevice(QIODevice *device, AbstractAlgorithm *algorithm);
+	virtual bool writeDevice(QIODevice *device, AbstractAlgorithm *algorithm);
+};
+
+#endif
@@ -17,9 +17,13 @@
  *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <QAction>
+#include <QApplication>
 #include <QFileDialog>
 #include <QFormLayout>
 #include <QLabel>
+#include <QMenu>
+#include <QMenuBar>
 #include <QStatusBar>
 
 #include "AbstractAlgorithm.h"
@@ -49,6 +53,8 @@ MainWindow::MainWindow(QWidget *parent)
 		m_population = new QLabel();
 		m_population->setTextInteractionFlags(Qt::TextSelectableByMouse | Qt::TextSelectableByKeyboard);
         layout->addRow(new QLabel(tr("Population: ")), m_population);
+		m_progress = new QLabel();
+		layout->addRow(new QLabel(tr("Step: ")), m_progress);
 		form->setLayout(layout);
 		statusBar()->addWidget(form);
 	}
@@ -90,6 +96,7 @@ MainWindow::MainWindow(QWidget *parent)
 	connect(AlgorithmManager::self(), SIGNAL(ruleChanged()), this, SLOT(ruleChanged()));
 	connect(AlgorithmManager::self(), SIGNAL(algorithmChanged()), this, SLOT(algorithmChanged()));
 	connect(AlgorithmManager::self(), SIGNAL(gridChanged()), this, SLOT(gridChanged()));
+	connect(AlgorithmManager::self(), SIGNAL(stepProgress(qulonglong, double)), this, SLOT(stepProgress(qulonglong, double)));
 
 	// TODO
 	AlgorithmManager::setRule(new RuleLife("3", "23"));
@@ -121,6 +128,12 @@ void MainWindow::gridChanged()
 {
 	m_generation->setText(AlgorithmManager::algorithm()->generation());
 	m_population->setText(AlgorithmManager::algorithm()->population());
+	m_progress->clear();
+}
+
+void MainWindow::stepProgress(qulonglong nodes, double fraction)
+{
+	m_progress->setText(tr("%1% (%2 nodes)").arg(static_cast<int>(fraction * 100)).arg(nodes));
 }
 
 void MainWindow::newAction()
@@ -135,23 +148,44 @@ void MainWindow::openAction()
 		return;
 }
 
+void MainWindow::saveAction()
+{
+	QString fileName = QFileDialog::getSaveFileName(this, tr("Save pattern"), QString(), FileFormatManager::fileFilter());
+	if (!FileFormatManager::writeFile(fileName))
+		return;
+}
+
 void MainWindow::setupActions()
 {
-/*	KAction *newAction = new KAction(this);
-	newAction->setText(i18n("&New pattern..."));
-	newAction->setIcon(KIcon("document-new"));
-	newAction->setShortcut(Qt::CTRL + Qt::Key_N);
-	actionCollection()->addAction("new", newAction);
+	QMenu *fileMenu = menuBar()->addMenu(tr("&File"));
+
+	QAction *newAction = new QAction(this);
+	newAction->setText(tr("&New pattern..."));
+	newAction->setIcon(QIcon::fromTheme("document-new"));
+	newAction->setShortcut(QKeySequence::New);
 	connect(newAction, SIGNAL(triggered()), this, SLOT(newAction()));
+	fileMenu->addAction(newAction);
 
-	KAction *openAction = new KAction(this);
-	openAction->setText(i18n("&Open pattern..."));
-	openAction->setIcon(KIcon("document-open"));
-	openAction->setShortcut(Qt::CTRL + Qt::Key_O);
-	actionCollection()->addAction("open", openAction);
+	QAction *openAction = new QAction(this);
+	openAction->setText(tr("&Open pattern..."));
+	openAction->setIcon(QIcon::fromTheme("document-open"));
+	openAction->setShortcut(QKeySequence::Open);
 	connect(openAction, SIGNAL(triggered()), this, SLOT(openAction()));
-
-	KStandardAction::quit(kapp, SLOT(quit()), actionCollection());
-
-    setupGUI();*/
+	fileMenu->addAction(openAction);
+
+	QAction *saveAction = new QAction(this);
+	saveAction->setText(tr("&Save pattern..."));
+	saveAction->setIcon(QIcon::fromTheme("document-save"));
+	saveAction->setShortcut(QKeySequence::Save);
+	connect(saveAction, SIGNAL(triggered()), this, SLOT(saveAction()));
+	fileMenu->addAction(saveAction);
+
+	fileMenu->addSeparator();
+
+	QAction *quitAction = new QAction(this);
+	quitAction->setText(tr("&Quit"));
+	quitAction->setIcon(QIcon::fromTheme("application-exit"));
+	quitAction->setShortcut(QKeySequence::Quit);
+	connect(quitAction, SIGNAL(triggered()), qApp, SLOT(quit()));
+	fileMenu->addAction(quitAction);
 }
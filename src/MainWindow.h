@@ -37,14 +37,16 @@ public slots:
 	void ruleChanged();
 	void algorithmChanged();
 	void gridChanged();
+	void stepProgress(qulonglong nodes, double fraction);
 	void newAction();
 	void openAction();
+	void saveAction();
 
 private:
 	void setupActions();
 
 	QLabel *m_coordinate_x, *m_coordinate_y;
-	QLabel *m_generation, *m_population;
+	QLabel *m_generation, *m_population, *m_progress;
 	QLabel *m_rule, *m_algorithm;
 	Editor *m_editor;
 };
@@ -0,0 +1,76 @@
+/*
+ *   Copyright (C) 2011 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <QFile>
+
+#include "MappedStream.h"
+
+const quint64 MappedStream::POWERS_OF_TEN[9] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+MappedStream::MappedStream(QFile *file)
+	: m_file(file), m_data(NULL), m_pos(NULL), m_end(NULL), m_success(true)
+{
+	if (file->size() > 0)
+		m_data = file->map(0, file->size());
+	if (m_data)
+	{
+		m_pos = reinterpret_cast<const char *>(m_data);
+		m_end = m_pos + file->size();
+	}
+}
+
+MappedStream::MappedStream(const char *begin, const char *end)
+	: m_file(NULL), m_data(NULL), m_pos(begin), m_end(end), m_success(true)
+{
+}
+
+MappedStream::~MappedStream()
+{
+	if (m_data)
+		m_file->unmap(m_data);
+}
+
+void MappedStream::skipLine()
+{
+	const char *eoln = reinterpret_cast<const char *>(memchr(m_pos, '\n', m_end - m_pos));
+	m_pos = eoln? eoln: m_end;
+}
+
+MappedStream& MappedStream::operator >> (int &num)
+{
+	skipWhiteSpace();
+	num = 0;
+	bool neg = false;
+	if (m_pos != m_end && (*m_pos == '+' || *m_pos == '-'))
+	{
+		neg = *m_pos == '-';
+		m_pos++;
+	}
+	if (m_pos == m_end || *m_pos < '0' || *m_pos > '9')
+	{
+		m_success = false;
+		return *this;
+	}
+	while (m_pos != m_end && *m_pos >= '0' && *m_pos <= '9')
+		num = num * 10 + *m_pos++ - '0';
+	if (neg)
+		num = -num;
+	m_success = true;
+	return *this;
+}
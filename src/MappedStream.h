@@ -0,0 +1,115 @@
+/*
+ *   Copyright (C) 2011 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef MAPPEDSTREAM_H
+#define MAPPEDSTREAM_H
+
+#include <cstdio>
+#include <cstring>
+
+#include <QtGlobal>
+
+class QFile;
+/// TextStream over a memory mapped file
+// Tokens are parsed in place from the mapped bytes. Runs of digits are
+// converted 8 bytes at a time, and lines are skipped with memchr().
+class MappedStream
+{
+public:
+	MappedStream(QFile *file);
+	/// Reads bytes mapped by another stream
+	MappedStream(const char *begin, const char *end);
+	~MappedStream();
+
+	/// Whether the file could be mapped, nothing can be read otherwise
+	bool isMapped() const { return m_data != NULL; }
+	bool atEnd() const { return m_pos == m_end; }
+	const char *pos() const { return m_pos; }
+	const char *end() const { return m_end; }
+	void skipLine();
+
+	operator bool() const { return m_success; }
+
+	inline MappedStream& operator >> (char &ch)
+	{
+		skipWhiteSpace();
+		ch = m_pos == m_end? EOF: *m_pos++;
+		m_success = true;
+		return *this;
+	}
+
+	MappedStream& operator >> (int &num);
+
+	inline MappedStream& operator >> (quint64 &num)
+	{
+		skipWhiteSpace();
+		num = 0;
+		m_success = false;
+#if defined(__GNUC__) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+		while (m_end - m_pos >= 8)
+		{
+			quint64 chunk;
+			memcpy(&chunk, m_pos, 8);
+			// Non zero for the bytes out of '0'..'9', the first character being the lowest byte
+			quint64 other = ((chunk & Q_UINT64_C(0xF0F0F0F0F0F0F0F0)) ^ Q_UINT64_C(0x3030303030303030))
+					| (((chunk + Q_UINT64_C(0x0606060606060606)) & Q_UINT64_C(0xF0F0F0F0F0F0F0F0)) ^ Q_UINT64_C(0x3030303030303030));
+			int digits = other? __builtin_ctzll(other) / 8: 8;
+			if (digits == 0)
+				return *this;
+			// Shifting fills the low bytes with leading zeros
+			num = num * POWERS_OF_TEN[digits] + parseDigits((chunk & Q_UINT64_C(0x0F0F0F0F0F0F0F0F)) << (8 * (8 - digits)));
+			m_pos += digits;
+			m_success = true;
+			if (digits < 8)
+				return *this;
+		}
+#endif
+		while (m_pos != m_end && *m_pos >= '0' && *m_pos <= '9')
+		{
+			num = num * 10 + *m_pos++ - '0';
+			m_success = true;
+		}
+		return *this;
+	}
+
+private:
+	static const quint64 POWERS_OF_TEN[9];
+
+	/// The number of 8 decimal digits, one per byte, the most significant being the lowest byte
+	static inline quint64 parseDigits(quint64 digits)
+	{
+		digits = (digits * 10 + (digits >> 8)) & Q_UINT64_C(0x00FF00FF00FF00FF);
+		digits = (digits * 100 + (digits >> 16)) & Q_UINT64_C(0x0000FFFF0000FFFF);
+		return (digits * 10000 + (digits >> 32)) & Q_UINT64_C(0x00000000FFFFFFFF);
+	}
+
+	inline void skipWhiteSpace()
+	{
+		// Mapped bytes have no \r\n translation
+		while (m_pos != m_end && (*m_pos == ' ' || *m_pos == '\t' || *m_pos == '\n' || *m_pos == '\r'))
+			m_pos++;
+	}
+
+	QFile *m_file;
+	uchar *m_data;
+	const char *m_pos, *m_end;
+	bool m_success;
+};
+
+#endif
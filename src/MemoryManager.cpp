@@ -20,37 +20,451 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QSet>
+#include <QThreadStorage>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
 #include "MemoryManager.h"
 
+// Chunks are aligned to CHUNK_SIZE, so the low bits of a chunk pointer are
+// free to hold a tag against the ABA problem of the lock-free stack
+static const quintptr TAG_MASK = CHUNK_SIZE - 1;
+static const size_t REGION_CHUNKS = REGION_SIZE / CHUNK_SIZE;
+
+static bool hugePages = false;
+
+// Regions are aligned to REGION_SIZE so the region of a chunk is found by masking
+static void *allocateRegion()
+{
+#ifdef Q_OS_UNIX
+	char *p = static_cast<char *>(mmap(NULL, REGION_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (p == MAP_FAILED)
+		return NULL;
+	char *region = reinterpret_cast<char *>((reinterpret_cast<quintptr>(p) + REGION_SIZE - 1) & ~static_cast<quintptr>(REGION_SIZE - 1));
+	if (region > p)
+		munmap(p, region - p);
+	munmap(region + REGION_SIZE, p + REGION_SIZE - region);
+#ifdef MADV_HUGEPAGE
+	if (hugePages)
+		madvise(region, REGION_SIZE, MADV_HUGEPAGE);
+#endif
+	return region;
+#else
+	return malloc(REGION_SIZE + REGION_SIZE);
+#endif
+}
+
+static void freeRegion(void *region)
+{
+#ifdef Q_OS_UNIX
+	munmap(region, REGION_SIZE);
+#else
+	free(region);
+#endif
+}
+
+/// Lock-free stack of empty chunks shared by all managers
+class ChunkPool
+{
+public:
+	ChunkPool()
+		: m_head(NULL)
+	{
+	}
+
+	~ChunkPool()
+	{
+		foreach (void *region, m_regions)
+			freeRegion(region);
+	}
+
+	MemoryChunk *pop()
+	{
+		// The next chunk is read in a region releaseRegions() could be unmapping
+		QReadLocker locker(&m_releaseLock);
+		for (;;)
+		{
+			MemoryChunk *head = m_head;
+			MemoryChunk *chunk = untag(head);
+			if (!chunk)
+				return newRegion();
+			// If another thread takes chunk meanwhile, next is garbage but the
+			// tag has changed and the exchange below fails
+			MemoryChunk *next = chunk->next;
+			if (m_head.testAndSetOrdered(head, tag(next, head)))
+			{
+				m_freeChunks.fetchAndAddRelaxed(-1);
+				return chunk;
+			}
+		}
+	}
+
+	void push(MemoryChunk *chunk)
+	{
+		m_freeChunks.fetchAndAddRelaxed(1);
+		for (;;)
+		{
+			MemoryChunk *head = m_head;
+			chunk->next = untag(head);
+			if (m_head.testAndSetOrdered(head, tag(chunk, head)))
+				return;
+		}
+	}
+
+	// Unmaps the regions whose chunks are all in the pool, pop() waits meanwhile
+	void releaseRegions()
+	{
+#ifdef Q_OS_UNIX
+		QWriteLocker locker(&m_releaseLock);
+		// Take the whole stack, so chunks pushed meanwhile are left alone
+		MemoryChunk *head;
+		do
+			head = m_head;
+		while (!m_head.testAndSetOrdered(head, tag(NULL, head)));
+		head = untag(head);
+		QHash<quintptr, int> freeChunks;
+		for (MemoryChunk *p = head; p; p = p->next)
+			freeChunks[reinterpret_cast<quintptr>(p) & ~static_cast<quintptr>(REGION_SIZE - 1)]++;
+		for (MemoryChunk *p = head, *next; p; p = next)
+		{
+			next = p->next;
+			m_freeChunks.fetchAndAddRelaxed(-1);
+			if (freeChunks.value(reinterpret_cast<quintptr>(p) & ~static_cast<quintptr>(REGION_SIZE - 1)) < static_cast<int>(REGION_CHUNKS))
+				push(p);
+		}
+		QMutexLocker regionLocker(&m_regionMutex);
+		for (QHash<quintptr, int>::const_iterator i = freeChunks.constBegin(); i != freeChunks.constEnd(); ++i)
+			if (i.value() == static_cast<int>(REGION_CHUNKS))
+			{
+				void *region = reinterpret_cast<void *>(i.key());
+				m_regions.removeOne(region);
+				freeRegion(region);
+			}
+#endif
+	}
+
+	quint64 reservedBytes()
+	{
+		QMutexLocker locker(&m_regionMutex);
+		return static_cast<quint64>(m_regions.size()) * REGION_SIZE;
+	}
+
+	quint64 freeBytes() const
+	{
+		return static_cast<quint64>(static_cast<int>(m_freeChunks)) * CHUNK_SIZE;
+	}
+
+private:
+	static inline MemoryChunk *untag(MemoryChunk *p)
+	{
+		return reinterpret_cast<MemoryChunk *>(reinterpret_cast<quintptr>(p) & ~TAG_MASK);
+	}
+
+	// Tags p with the successor of the tag of old
+	static inline MemoryChunk *tag(MemoryChunk *p, MemoryChunk *old)
+	{
+		return reinterpret_cast<MemoryChunk *>(reinterpret_cast<quintptr>(p) | ((reinterpret_cast<quintptr>(old) + 1) & TAG_MASK));
+	}
+
+	MemoryChunk *newRegion()
+	{
+		char *region = static_cast<char *>(allocateRegion());
+		if (!region)
+			qFatal("Out of memory.");
+		{
+			QMutexLocker locker(&m_regionMutex);
+			m_regions.append(region);
+		}
+#ifndef Q_OS_UNIX
+		// malloc() gave an unaligned block twice as large
+		region = reinterpret_cast<char *>((reinterpret_cast<quintptr>(region) + REGION_SIZE - 1) & ~static_cast<quintptr>(REGION_SIZE - 1));
+#endif
+		for (size_t i = 1; i < REGION_CHUNKS; i++)
+			push(reinterpret_cast<MemoryChunk *>(region + i * CHUNK_SIZE));
+		return reinterpret_cast<MemoryChunk *>(region);
+	}
+
+	QAtomicPointer<MemoryChunk> m_head;
+	QAtomicInt m_freeChunks;
+	QMutex m_regionMutex;
+	QList<void *> m_regions;
+	QReadWriteLock m_releaseLock;
+};
+
+// The first object of a batch in the depot, the others follow through next
+struct MemoryBatch
+{
+	MemoryChunk *next;
+	MemoryBatch *nextBatch;
+};
+
+/// Batches of free objects given back by the managers
+// Only touched once every MAGAZINE_SIZE allocations or frees, so a lock is cheap enough
+struct Depot
+{
+	Depot()
+	{
+		memset(batches, 0, sizeof batches);
+		memset(counts, 0, sizeof counts);
+	}
+
+	QMutex mutex;
+	MemoryBatch *batches[SIZE_CLASSES];
+	size_t counts[SIZE_CLASSES];
+};
+
+/// Every live manager, for releaseMemory() and usage()
+struct Registry
+{
+	QMutex mutex;
+	QSet<MemoryManager *> managers;
+};
+
+Q_GLOBAL_STATIC(ChunkPool, globalChunkPool)
+Q_GLOBAL_STATIC(Depot, globalDepot)
+Q_GLOBAL_STATIC(Registry, globalRegistry)
+Q_GLOBAL_STATIC(QThreadStorage<MemoryManager *>, localMemoryManager)
+
+// The number of chunks carved into objects of each size class
+static QAtomicInt classChunks[SIZE_CLASSES];
+
 MemoryManager::MemoryManager()
-	: head(NULL)
 {
-	memset(heads, 0, sizeof heads);
+	memset(m_heads, 0, sizeof m_heads);
+	memset(m_counts, 0, sizeof m_counts);
+	memset(&m_statistics, 0, sizeof m_statistics);
+	Registry *registry = globalRegistry();
+	QMutexLocker locker(&registry->mutex);
+	registry->managers.insert(this);
 }
 
+// Free objects go to the depot for other managers
 MemoryManager::~MemoryManager()
 {
-	while (head)
+	// At exit the globals may be gone already
+	Registry *registry = globalRegistry();
+	if (!registry || !globalDepot())
+		return;
+	QMutexLocker locker(&registry->mutex);
+	registry->managers.remove(this);
+	for (size_t sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++)
+		if (hasBatches(sizeClass))
+			while (m_counts[sizeClass])
+				returnBatch(sizeClass, qMin(m_counts[sizeClass], MAGAZINE_SIZE));
+}
+
+MemoryManager *MemoryManager::local()
+{
+	QThreadStorage<MemoryManager *> *storage = localMemoryManager();
+	if (!storage->hasLocalData())
+		storage->setLocalData(new MemoryManager());
+	return storage->localData();
+}
+
+void MemoryManager::releaseMemory()
+{
+	Registry *registry = globalRegistry();
+	Depot *depot = globalDepot();
+	QMutexLocker registryLocker(&registry->mutex);
+	QMutexLocker depotLocker(&depot->mutex);
+	QList<MemoryManager *> managers = registry->managers.toList();
+	for (size_t sizeClass = 1; sizeClass < SIZE_CLASSES; sizeClass++)
+		if (static_cast<int>(classChunks[sizeClass]))
+			releaseChunks(sizeClass, managers);
+	globalChunkPool()->releaseRegions();
+}
+
+// A chunk whose objects are all free in managers or in the depot is used by
+// no other manager, which may go on meanwhile: the depot is locked, and the
+// chunk pool keeps them out while it unmaps regions
+void MemoryManager::releaseMemory(const QList<MemoryManager *> &managers)
+{
+	Depot *depot = globalDepot();
+	QMutexLocker depotLocker(&depot->mutex);
+	for (size_t sizeClass = 1; sizeClass < SIZE_CLASSES; sizeClass++)
+		if (static_cast<int>(classChunks[sizeClass]))
+			releaseChunks(sizeClass, managers);
+	globalChunkPool()->releaseRegions();
+}
+
+// Finds the chunks of a size class all of whose objects are free, takes
+// these objects out of the managers and the depot, and pools the chunks
+void MemoryManager::releaseChunks(size_t sizeClass, const QList<MemoryManager *> &managers)
+{
+	Depot *depot = globalDepot();
+	const int capacity = CHUNK_SIZE / (sizeClass * SLOT_SIZE);
+	QHash<quintptr, int> freeObjects;
+	foreach (MemoryManager *manager, managers)
+		for (MemoryChunk *p = manager->m_heads[sizeClass]; p; p = p->next)
+			freeObjects[reinterpret_cast<quintptr>(p) & ~TAG_MASK]++;
+	for (MemoryBatch *batch = depot->batches[sizeClass]; batch; batch = batch->nextBatch)
+		for (MemoryChunk *p = reinterpret_cast<MemoryChunk *>(batch); p; p = p->next)
+			freeObjects[reinterpret_cast<quintptr>(p) & ~TAG_MASK]++;
+	QSet<quintptr> emptyChunks;
+	for (QHash<quintptr, int>::const_iterator i = freeObjects.constBegin(); i != freeObjects.constEnd(); ++i)
+		if (i.value() == capacity)
+			emptyChunks.insert(i.key());
+	if (emptyChunks.isEmpty())
+		return;
+	// Keep the other objects where they are
+	foreach (MemoryManager *manager, managers)
+	{
+		MemoryChunk **p = &manager->m_heads[sizeClass];
+		while (*p)
+			if (emptyChunks.contains(reinterpret_cast<quintptr>(*p) & ~TAG_MASK))
+			{
+				*p = (*p)->next;
+				manager->m_counts[sizeClass]--;
+			}
+			else
+				p = &(*p)->next;
+	}
+	// Batches in the depot are rebuilt from their remaining objects
+	MemoryChunk *remaining = NULL;
+	for (MemoryBatch *batch = depot->batches[sizeClass], *nextBatch; batch; batch = nextBatch)
 	{
-		MemoryChunk *next = head->next;
-		delete head;
-		head = next;
+		nextBatch = batch->nextBatch;
+		for (MemoryChunk *p = reinterpret_cast<MemoryChunk *>(batch), *next; p; p = next)
+		{
+			next = p->next;
+			if (!emptyChunks.contains(reinterpret_cast<quintptr>(p) & ~TAG_MASK))
+			{
+				p->next = remaining;
+				remaining = p;
+			}
+		}
 	}
+	depot->batches[sizeClass] = NULL;
+	depot->counts[sizeClass] = 0;
+	while (remaining)
+	{
+		MemoryBatch *batch = reinterpret_cast<MemoryBatch *>(remaining);
+		MemoryChunk *last = remaining;
+		size_t count = 1;
+		for (; count < MAGAZINE_SIZE && last->next; count++)
+			last = last->next;
+		remaining = last->next;
+		last->next = NULL;
+		batch->nextBatch = depot->batches[sizeClass];
+		depot->batches[sizeClass] = batch;
+		depot->counts[sizeClass] += count;
+	}
+	foreach (quintptr chunk, emptyChunks)
+		globalChunkPool()->push(reinterpret_cast<MemoryChunk *>(chunk));
+	classChunks[sizeClass].fetchAndAddRelaxed(-emptyChunks.size());
 }
 
-MemoryChunk *MemoryManager::newChunk()
+MemoryManager::Usage MemoryManager::usage()
 {
-	if (head)
+	Registry *registry = globalRegistry();
+	Depot *depot = globalDepot();
+	QMutexLocker registryLocker(&registry->mutex);
+	QMutexLocker depotLocker(&depot->mutex);
+	ChunkPool *pool = globalChunkPool();
+	Usage ret;
+	ret.reserved = pool->reservedBytes();
+	ret.free = pool->freeBytes();
+	ret.used = 0;
+	for (size_t sizeClass = 1; sizeClass < SIZE_CLASSES; sizeClass++)
+	{
+		int chunks = classChunks[sizeClass];
+		if (!chunks)
+			continue;
+		SizeUsage size;
+		size.size = sizeClass * SLOT_SIZE;
+		size.reserved = static_cast<quint64>(chunks) * CHUNK_SIZE;
+		quint64 freeObjects = depot->counts[sizeClass];
+		foreach (MemoryManager *manager, registry->managers)
+			freeObjects += manager->m_counts[sizeClass];
+		size.used = qMin(size.reserved, static_cast<quint64>(chunks) * (CHUNK_SIZE / size.size) * size.size - freeObjects * size.size);
+		size.free = size.reserved - size.used;
+		ret.used += size.used;
+		ret.free += size.free;
+		ret.sizes.append(size);
+	}
+	return ret;
+}
+
+bool MemoryManager::useHugePages()
+{
+	return hugePages;
+}
+
+void MemoryManager::setUseHugePages(bool useHugePages)
+{
+	hugePages = useHugePages;
+}
+
+// A batch needs two pointers in its first object, smaller objects stay in their manager
+bool MemoryManager::hasBatches(size_t sizeClass)
+{
+	return sizeClass * SLOT_SIZE >= sizeof(MemoryBatch);
+}
+
+void MemoryManager::refill(size_t sizeClass)
+{
+	if (hasBatches(sizeClass))
+	{
+		Depot *depot = globalDepot();
+		MemoryBatch *batch;
+		{
+			QMutexLocker locker(&depot->mutex);
+			batch = depot->batches[sizeClass];
+			if (batch)
+				depot->batches[sizeClass] = batch->nextBatch;
+			if (batch)
+			{
+				m_heads[sizeClass] = reinterpret_cast<MemoryChunk *>(batch);
+				for (MemoryChunk *p = m_heads[sizeClass]; p; p = p->next)
+					m_counts[sizeClass]++;
+				depot->counts[sizeClass] -= m_counts[sizeClass];
+			}
+		}
+		if (batch)
+		{
+			m_statistics.batchesTaken++;
+			return;
+		}
+	}
+	char *chunk = reinterpret_cast<char *>(globalChunkPool()->pop());
+	size_t size = sizeClass * SLOT_SIZE;
+	MemoryChunk *head = NULL;
+	for (char *p = chunk; p + size <= chunk + CHUNK_SIZE; p += size)
 	{
-		MemoryChunk *ret = head;
-		head = head->next;
-		return ret;
+		reinterpret_cast<MemoryChunk *>(p)->next = head;
+		head = reinterpret_cast<MemoryChunk *>(p);
+		m_counts[sizeClass]++;
 	}
-	return static_cast<MemoryChunk *>(malloc(CHUNK_SIZE));
+	m_heads[sizeClass] = head;
+	classChunks[sizeClass].fetchAndAddRelaxed(1);
+	m_statistics.chunks++;
 }
 
-void MemoryManager::deleteChunk(MemoryChunk *chunk)
+// Gives count free objects of the size class to the depot
+void MemoryManager::returnBatch(size_t sizeClass, size_t count)
 {
-	chunk->next = head;
-	head = chunk;
+	if (!hasBatches(sizeClass))
+		return;
+	MemoryChunk *first = m_heads[sizeClass], *last = first;
+	for (size_t i = 1; i < count; i++)
+		last = last->next;
+	m_heads[sizeClass] = last->next;
+	m_counts[sizeClass] -= count;
+	last->next = NULL;
+	MemoryBatch *batch = reinterpret_cast<MemoryBatch *>(first);
+	Depot *depot = globalDepot();
+	QMutexLocker locker(&depot->mutex);
+	batch->nextBatch = depot->batches[sizeClass];
+	depot->batches[sizeClass] = batch;
+	depot->counts[sizeClass] += count;
+	m_statistics.batchesReturned++;
 }
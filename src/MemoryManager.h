@@ -22,58 +22,111 @@
 
 #include <cstdlib>
 
-const size_t CHUNK_SIZE = 8192 - 16;
+#include <QList>
+#include <QtGlobal>
+
+const size_t CHUNK_SIZE = 8192;
+// Objects are given slots of a multiple of SLOT_SIZE bytes
+const size_t SLOT_SIZE = 8;
+const size_t SIZE_CLASSES = CHUNK_SIZE / SLOT_SIZE + 1;
+// Chunks are reserved from the system in regions of REGION_SIZE bytes
+const size_t REGION_SIZE = 2 << 20;
 
 struct MemoryChunk
 {
 	MemoryChunk *next;
 };
 
+/// Allocator of small fixed size objects
+// A MemoryManager is not thread safe, every thread should have its own one,
+// local() for instance. Free objects are kept in per size magazines; above
+// twice MAGAZINE_SIZE a batch goes back to a depot shared by all managers,
+// and an empty magazine is refilled from the depot before new chunks are
+// taken from the lock-free chunk pool.
 class MemoryManager
 {
 public:
+	struct Statistics
+	{
+		quint64 allocations, frees;
+		quint64 chunks;
+		quint64 batchesTaken, batchesReturned;
+	};
+
+	/// Bytes of the chunks given to one object size
+	struct SizeUsage
+	{
+		size_t size;
+		quint64 reserved, used, free;
+	};
+
+	struct Usage
+	{
+		/// Bytes reserved from the system, used by objects, and free in chunks or in the chunk pool
+		quint64 reserved, used, free;
+		QList<SizeUsage> sizes;
+	};
+
 	MemoryManager();
 	~MemoryManager();
 
+	/// The manager of the calling thread, deleted when the thread finishes
+	static MemoryManager *local();
+
+	/// Gives the chunks holding no object back to the pool, and the regions holding no chunk back to the system
+	// No manager may be in use meanwhile.
+	static void releaseMemory();
+	/// Same as releaseMemory(), but only the objects freed in managers or in the depot are looked at
+	// Only these managers may not be in use meanwhile.
+	static void releaseMemory(const QList<MemoryManager *> &managers);
+	/// Approximate if managers are in use meanwhile
+	static Usage usage();
+	static bool useHugePages();
+	/// Asks for transparent huge pages for the regions reserved from now on
+	static void setUseHugePages(bool useHugePages);
+
 	template <typename T>
 	T *newObject()
 	{
-		size_t size = sizeof(T);
-		if (heads[size])
-		{
-			T *ret = reinterpret_cast<T *>(heads[size]);
-			heads[size] = heads[size]->next;
-			return ret;
-		}
-		T *p = reinterpret_cast<T *>(newChunk());
-		reinterpret_cast<MemoryChunk *>(p)->next = NULL;
-		char *end = reinterpret_cast<char *>(p) + CHUNK_SIZE;
-		for (;;)
-		{
-			T *q = p + 1;
-			if (reinterpret_cast<char *>(q) + sizeof(T) > end)
-			{
-				heads[size] = reinterpret_cast<MemoryChunk *>(p)->next;
-				return p;
-			}
-			reinterpret_cast<MemoryChunk *>(q)->next = reinterpret_cast<MemoryChunk *>(p);
-			p = q;
-		}
+		size_t sizeClass = sizeClassOf(sizeof(T));
+		if (!m_heads[sizeClass])
+			refill(sizeClass);
+		MemoryChunk *ret = m_heads[sizeClass];
+		m_heads[sizeClass] = ret->next;
+		m_counts[sizeClass]--;
+		m_statistics.allocations++;
+		return reinterpret_cast<T *>(ret);
 	}
 
 	template <typename T>
 	void deleteObject(T *object)
 	{
-		size_t size = sizeof(T);
-		reinterpret_cast<MemoryChunk *>(object)->next = heads[size];
-		heads[size] = reinterpret_cast<MemoryChunk *>(object);
+		size_t sizeClass = sizeClassOf(sizeof(T));
+		reinterpret_cast<MemoryChunk *>(object)->next = m_heads[sizeClass];
+		m_heads[sizeClass] = reinterpret_cast<MemoryChunk *>(object);
+		m_statistics.frees++;
+		if (++m_counts[sizeClass] >= MAGAZINE_SIZE * 2)
+			returnBatch(sizeClass, MAGAZINE_SIZE);
 	}
 
+	const Statistics &statistics() const { return m_statistics; }
+
 private:
-	MemoryChunk *newChunk();
-	void deleteChunk(MemoryChunk *chunk);
+	static const size_t MAGAZINE_SIZE = 256;
+
+	static inline size_t sizeClassOf(size_t size)
+	{
+		return (size + SLOT_SIZE - 1) / SLOT_SIZE;
+	}
+
+	static bool hasBatches(size_t sizeClass);
+	static void releaseChunks(size_t sizeClass, const QList<MemoryManager *> &managers);
+	void refill(size_t sizeClass);
+	void returnBatch(size_t sizeClass, size_t count);
 
-	MemoryChunk *head, *heads[CHUNK_SIZE];
+	MemoryChunk *m_heads[SIZE_CLASSES];
+	size_t m_counts[SIZE_CLASSES];
+	Statistics m_statistics;
 };
 
 #endif
@@ -17,16 +17,249 @@
  *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <cstring>
+
+#include <QFile>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThread>
+#include <QThreadPool>
+#include <QVector>
+
 #include "AbstractAlgorithm.h"
+#include "AlgorithmManager.h"
 #include "BigInteger.h"
 #include "DataChannel.h"
 #include "FileFormatManager.h"
+#include "MappedStream.h"
 #include "RLEFormat.h"
+#include "Rule.h"
 #include "TextStream.h"
 #include "Utils.h"
 
 REGISTER_FILEFORMAT(RLEFormat)
 
+// Bodies smaller than this are not worth splitting
+static const int PARALLEL_SIZE = 1 << 22;
+static const int CHUNK_SIZE = 1 << 20;
+// Written lines are at most this long
+static const int LINE_LENGTH = 70;
+// Written text is given to the device in pieces of this size
+static const int WRITE_SIZE = 1 << 16;
+
+/// Parses a piece of an RLE body into runs
+class RLEChunk: public QRunnable
+{
+public:
+	RLEChunk(const char *begin, const char *end)
+		: m_begin(begin), m_end(end), m_ok(true)
+	{
+		setAutoDelete(false);
+	}
+
+	/// Waits for run() to finish
+	void wait()
+	{
+		m_done.acquire();
+	}
+
+	bool ok() const { return m_ok; }
+	const QVector<int> &states() const { return m_states; }
+	const QVector<quint64> &counts() const { return m_counts; }
+
+private:
+	virtual void run()
+	{
+		MappedStream S(m_begin, m_end);
+		while (!S.atEnd())
+		{
+			char ch;
+			quint64 cnt;
+			bool counted = S >> cnt;
+			S >> ch;
+			if (!counted)
+				cnt = 1;
+			if (ch == 'o')
+				append(1, cnt);
+			else if (ch == 'b')
+				append(0, cnt);
+			else if (ch == '$')
+				append(DATACHANNEL_EOLN, cnt);
+			// Unknown tags are skipped after a count, as in RLEFormat::read()
+			else if (ch != EOF && !counted)
+			{
+				m_ok = false;
+				break;
+			}
+		}
+		m_done.release();
+	}
+
+	inline void append(int state, quint64 cnt)
+	{
+		m_states.append(state);
+		m_counts.append(cnt);
+	}
+
+	const char *m_begin, *m_end;
+	bool m_ok;
+	QVector<int> m_states;
+	QVector<quint64> m_counts;
+	QSemaphore m_done;
+};
+
+/// Buffered devices are always read serially
+static inline bool readBody(TextStream &, DataChannel *, bool *)
+{
+	return false;
+}
+
+/// Parses the body of a big mapped file on several threads, returns false if it has to be read serially
+// The body is split into chunks, each ending right after a tag so no token
+// is cut. Chunks are parsed by a thread pool, at most two per thread ahead
+// of the one being sent, and their runs are sent in order.
+static bool readBody(MappedStream &S, DataChannel *channel, bool *ok)
+{
+	const char *begin = S.pos();
+	int threadCount = QThread::idealThreadCount();
+	if (S.end() - begin < PARALLEL_SIZE || threadCount < 2)
+		return false;
+	const char *end = reinterpret_cast<const char *>(memchr(begin, '!', S.end() - begin));
+	// Comment lines could be cut in the middle
+	if (!end || memchr(begin, '#', end - begin))
+		return false;
+
+	QVector<RLEChunk *> chunks;
+	while (begin < end)
+	{
+		const char *p = end - begin > CHUNK_SIZE? begin + CHUNK_SIZE: end;
+		while (p < end && ((*p >= '0' && *p <= '9') || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+			p++;
+		if (p < end)
+			p++;
+		chunks.append(new RLEChunk(begin, p));
+		begin = p;
+	}
+
+	QThreadPool threadPool;
+	threadPool.setMaxThreadCount(threadCount);
+	int started = qMin(chunks.size(), threadCount * 2);
+	for (int i = 0; i < started; i++)
+		threadPool.start(chunks[i]);
+	*ok = true;
+	int sent = 0;
+	for (; sent < chunks.size(); sent++)
+	{
+		chunks[sent]->wait();
+		if (!chunks[sent]->ok())
+		{
+			*ok = false;
+			break;
+		}
+		for (int j = 0; j < chunks[sent]->states().size(); j++)
+			channel->send(chunks[sent]->states()[j], chunks[sent]->counts()[j]);
+		delete chunks[sent];
+		if (started < chunks.size())
+			threadPool.start(chunks[started++]);
+	}
+	// After a bad chunk the others are dropped, and as in read() the body is left without its end
+	threadPool.waitForDone();
+	for (int i = sent; i < chunks.size(); i++)
+		delete chunks[i];
+	if (*ok)
+		channel->send(DATACHANNEL_EOF, 1);
+	return true;
+}
+
+/// Writes runs as RLE tokens, merging the runs of the same tag
+// Dead cells at the end of a row and rows at the end of the pattern are
+// left out.
+class RLEWriter
+{
+public:
+	RLEWriter(QIODevice *device)
+		: m_device(device), m_ok(true), m_tag(0), m_count(0), m_rows(0), m_lineLength(0)
+	{
+	}
+
+	void append(char tag, quint64 cnt)
+	{
+		if (tag == '$')
+		{
+			// Rows holding only dead cells add up to a single token
+			if (m_tag == 'o')
+				writeRun();
+			m_tag = 0;
+			m_count = 0;
+			m_rows += cnt;
+			return;
+		}
+		if (tag == m_tag)
+		{
+			m_count += cnt;
+			return;
+		}
+		if (m_tag)
+			writeRun();
+		m_tag = tag;
+		m_count = cnt;
+	}
+
+	/// Ends the pattern, returns whether everything was written
+	bool finish()
+	{
+		if (m_tag == 'o')
+			writeRun();
+		writeToken('!', 1);
+		m_buffer += '\n';
+		flush();
+		return m_ok;
+	}
+
+private:
+	void writeRun()
+	{
+		writeToken('$', m_rows);
+		m_rows = 0;
+		writeToken(m_tag, m_count);
+	}
+
+	void writeToken(char tag, quint64 count)
+	{
+		if (!count)
+			return;
+		QByteArray token;
+		if (count > 1)
+			token = QByteArray::number(count);
+		token += tag;
+		if (m_lineLength + token.size() > LINE_LENGTH)
+		{
+			m_buffer += '\n';
+			m_lineLength = 0;
+		}
+		m_buffer += token;
+		m_lineLength += token.size();
+		if (m_buffer.size() >= WRITE_SIZE)
+			flush();
+	}
+
+	void flush()
+	{
+		if (m_device->write(m_buffer) != m_buffer.size())
+			m_ok = false;
+		m_buffer.clear();
+	}
+
+	QIODevice *m_device;
+	bool m_ok;
+	QByteArray m_buffer;
+	// The run waiting to be merged with the next ones, after m_rows row ends
+	char m_tag;
+	quint64 m_count;
+	quint64 m_rows;
+	int m_lineLength;
+};
+
 QString RLEFormat::formatName() const
 {
 	return "RLE Image";
@@ -39,8 +272,71 @@ QList<QString> RLEFormat::supportedFormats() const
 
 bool RLEFormat::readDevice(QIODevice *device, AbstractAlgorithm *algorithm)
 {
-	DataChannel *channel = NULL;
+	// Local files are parsed in place, other devices are read through a buffer
+	QFile *file = qobject_cast<QFile *>(device);
+	if (file)
+	{
+		MappedStream S(file);
+		if (S.isMapped())
+			return read(S, algorithm);
+	}
 	TextStream S(device);
+	return read(S, algorithm);
+}
+
+bool RLEFormat::writeDevice(QIODevice *device, AbstractAlgorithm *algorithm)
+{
+	// The header and the cells are of the same generation, even with a step running meanwhile
+	int slot;
+	const Snapshot *snapshot = algorithm->acquireSnapshot(&slot);
+	algorithm->setSendSnapshot(snapshot);
+	bool ret = writeSnapshot(device, algorithm, snapshot->generation);
+	algorithm->setSendSnapshot(NULL);
+	algorithm->releaseSnapshot(slot);
+	return ret;
+}
+
+bool RLEFormat::writeSnapshot(QIODevice *device, AbstractAlgorithm *algorithm, const BigInteger &generation)
+{
+	BigInteger x, y;
+	quint64 w, h;
+	if (!algorithm->boundingRect(&x, &y, &w, &h))
+		return false;
+	// The position is kept in a comment, as Golly does
+	QString header = QString("#CXRLE Pos=%1,%2 Gen=%3\nx = %4, y = %5, rule = %6\n")
+			.arg(static_cast<QString>(x), static_cast<QString>(y), static_cast<QString>(generation))
+			.arg(w).arg(h).arg(AlgorithmManager::rule()->string());
+	if (device->write(header.toAscii()) < 0)
+		return false;
+	RLEWriter writer(device);
+	if (w && h)
+	{
+		algorithm->setSendRect(x, y, w, h);
+		DataChannel *channel = DataChannel::transferFrom(algorithm);
+		int state;
+		quint64 cnt;
+		do
+		{
+			channel->receive(&state, &cnt);
+			if (state == DATACHANNEL_EOLN)
+				writer.append('$', cnt);
+			else if (state == DATACHANNEL_BITS)
+			{
+				quint64 count = DataChannel::cellCount(state, cnt);
+				for (quint64 i = 0; i < count; i++)
+					writer.append(TEST_BIT(cnt, i)? 'o': 'b', 1);
+			}
+			else if (state >= 0)
+				writer.append(state? 'o': 'b', cnt);
+		} while (state != DATACHANNEL_EOF);
+	}
+	return writer.finish();
+}
+
+template <typename Stream>
+bool RLEFormat::read(Stream &S, AbstractAlgorithm *algorithm)
+{
+	DataChannel *channel = NULL;
 	BigInteger x1, y1;
 	int w, h;
 	while (!S.atEnd())
@@ -81,6 +377,9 @@ bool RLEFormat::readDevice(QIODevice *device, AbstractAlgorithm *algorithm)
 				S.skipLine();
 				algorithm->setReceiveRect(x1, y1, w, h);
 				channel = DataChannel::transferTo(algorithm);
+				bool ok;
+				if (readBody(S, channel, &ok))
+					return ok;
 			}
 			else if (ch == '$')
 				channel->send(DATACHANNEL_EOLN, 1);
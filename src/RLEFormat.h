@@ -22,12 +22,19 @@
 
 #include "AbstractFileFormat.h"
 
+class BigInteger;
 class RLEFormat: public AbstractFileFormat
 {
 public:
 	virtual QString formatName() const;
 	virtual QList<QString> supportedFormats() const;
 	virtual bool readDevice(QIODevice *device, AbstractAlgorithm *algorithm);
+	virtual bool writeDevice(QIODevice *device, AbstractAlgorithm *algorithm);
+
+private:
+	template <typename Stream>
+	bool read(Stream &S, AbstractAlgorithm *algorithm);
+	bool writeSnapshot(QIODevice *device, AbstractAlgorithm *algorithm, const BigInteger &generation);
 };
 
 #endif
@@ -0,0 +1,117 @@
+/*
+ *   Copyright (C) 2011 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "AlgorithmManager.h"
+#include "CanvasPainter.h"
+#include "RenderThread.h"
+#include "TileCache.h"
+
+RenderThread::RenderThread(QObject *parent)
+	: QThread(parent), m_pending(false), m_clearTiles(false), m_quit(false), m_tileCache(new TileCache())
+{
+	start();
+}
+
+RenderThread::~RenderThread()
+{
+	m_mutex.lock();
+	m_quit = true;
+	m_condition.wakeOne();
+	m_mutex.unlock();
+	wait();
+	delete m_tileCache;
+}
+
+void RenderThread::render(const QSize &size, const BigInteger &view_x, const BigInteger &view_y, int x1, int x2, int y1, int y2, int scale, int scalePixel)
+{
+	View view;
+	view.size = size;
+	view.view_x = view_x;
+	view.view_y = view_y;
+	view.x1 = x1;
+	view.x2 = x2;
+	view.y1 = y1;
+	view.y2 = y2;
+	view.scale = scale;
+	view.scalePixel = scalePixel;
+	m_mutex.lock();
+	if (!(view == m_view))
+	{
+		m_view = view;
+		m_pending = true;
+		m_condition.wakeOne();
+	}
+	m_mutex.unlock();
+}
+
+QImage RenderThread::frame()
+{
+	m_mutex.lock();
+	QImage ret = m_frame;
+	m_mutex.unlock();
+	return ret;
+}
+
+void RenderThread::invalidate()
+{
+	m_mutex.lock();
+	m_clearTiles = true;
+	m_pending = true;
+	m_condition.wakeOne();
+	m_mutex.unlock();
+}
+
+void RenderThread::run()
+{
+	forever
+	{
+		m_mutex.lock();
+		while (!m_pending && !m_quit)
+			m_condition.wait(&m_mutex);
+		if (m_quit)
+		{
+			m_mutex.unlock();
+			return;
+		}
+		View view = m_view;
+		bool clearTiles = m_clearTiles;
+		m_pending = false;
+		m_clearTiles = false;
+		m_mutex.unlock();
+
+		if (view.size.isEmpty())
+			continue;
+		if (clearTiles)
+			m_tileCache->clear();
+		if (m_back.size() != view.size)
+			m_back = QImage(view.size, QImage::Format_RGB32);
+		{
+			// The algorithm paints in the constructor
+			AlgorithmManager::lockAlgorithm();
+			CanvasPainter painter(&m_back, view.view_x, view.view_y, view.x1, view.x2, view.y1, view.y2, view.scale, view.scalePixel, m_tileCache);
+			AlgorithmManager::unlockAlgorithm();
+			painter.drawPattern();
+			painter.drawGridLine();
+		}
+		m_mutex.lock();
+		qSwap(m_frame, m_back);
+		m_mutex.unlock();
+		emit frameReady();
+	}
+}
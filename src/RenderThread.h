@@ -0,0 +1,87 @@
+/*
+ *   Copyright (C) 2011 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RENDERTHREAD_H
+#define RENDERTHREAD_H
+
+#include <QImage>
+#include <QMutex>
+#include <QSize>
+#include <QThread>
+#include <QWaitCondition>
+
+#include "BigInteger.h"
+
+class TileCache;
+/// Renders the frames of the editor off the GUI thread
+// A frame is drawn into a back buffer, then swapped with the front one
+// under m_mutex, so frame() always returns a finished frame. Requests
+// coming while a frame is drawn are merged, only the latest view is drawn
+// next. The tile cache is only touched by this thread.
+class RenderThread: public QThread
+{
+	Q_OBJECT
+
+public:
+	RenderThread(QObject *parent = 0);
+	virtual ~RenderThread();
+
+	/// Asks for a frame of the view unless it is already asked for
+	void render(const QSize &size, const BigInteger &view_x, const BigInteger &view_y, int x1, int x2, int y1, int y2, int scale, int scalePixel);
+	/// The latest finished frame, which may show another view
+	QImage frame();
+
+public slots:
+	/// Draws the view again, the rendered tiles are out of date
+	void invalidate();
+
+signals:
+	void frameReady();
+
+private:
+	struct View
+	{
+		View(): x1(0), x2(0), y1(0), y2(0), scale(0), scalePixel(0) {}
+
+		bool operator == (const View &view) const
+		{
+			return size == view.size && view_x == view.view_x && view_y == view.view_y
+					&& x1 == view.x1 && x2 == view.x2 && y1 == view.y1 && y2 == view.y2
+					&& scale == view.scale && scalePixel == view.scalePixel;
+		}
+
+		QSize size;
+		BigInteger view_x, view_y;
+		int x1, x2, y1, y2, scale, scalePixel;
+	};
+
+	virtual void run();
+
+	QMutex m_mutex;
+	QWaitCondition m_condition;
+	// The latest view asked for, and whether it is still to be drawn
+	View m_view;
+	bool m_pending;
+	bool m_clearTiles;
+	bool m_quit;
+	QImage m_frame, m_back;
+	TileCache *m_tileCache;
+};
+
+#endif
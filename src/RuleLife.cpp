@@ -36,6 +36,32 @@ static inline int stringToRule(QString str)
 	return ret;
 }
 
+static inline bool isRuleString(QString str)
+{
+	for (int i = 0; i < str.length(); i++)
+		if (str.at(i).digitValue() < 0 || str.at(i).digitValue() > 8)
+			return false;
+	return true;
+}
+
+RuleLife *RuleLife::fromString(const QString &rule)
+{
+	QList<QString> parts = rule.split("/");
+	if (parts.size() != 2)
+		return NULL;
+	QString b = parts[1], s = parts[0];
+	if (parts[0].startsWith("B") || parts[0].startsWith("b"))
+	{
+		if (!parts[1].startsWith("S") && !parts[1].startsWith("s"))
+			return NULL;
+		b = parts[0].mid(1);
+		s = parts[1].mid(1);
+	}
+	if (!isRuleString(b) || !isRuleString(s))
+		return NULL;
+	return new RuleLife(b, s);
+}
+
 QString RuleLife::B() const
 {
 	return ruleToString(b);
@@ -49,9 +75,24 @@ QString RuleLife::S() const
 void RuleLife::setB(QString str)
 {
 	b = stringToRule(str);
+	compile();
 }
 
 void RuleLife::setS(QString str)
 {
 	s = stringToRule(str);
+	compile();
+}
+
+void RuleLife::compile()
+{
+	m_matchCount = 0;
+	for (int n = 0; n <= 8; n++)
+		if (TEST_BIT(b, n) || TEST_BIT(s, n))
+		{
+			Match &m = m_matches[m_matchCount++];
+			m.count = n;
+			m.born = TEST_BIT(b, n) > 0;
+			m.survive = TEST_BIT(s, n) > 0;
+		}
 }
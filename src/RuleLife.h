@@ -26,7 +26,9 @@
 class RuleLife: public Rule
 {
 public:
-	RuleLife(QString b = "", QString s = "") { setBS(b, s); }
+	RuleLife(QString b = "", QString s = ""): b(0), s(0) { setBS(b, s); }
+	/// The rule written as B3/S23 or as 23/3, NULL if rule is neither
+	static RuleLife *fromString(const QString &rule);
 
 	virtual RuleType type() const { return Rule::Life; }
 	virtual QString name() const { return "Life"; }
@@ -41,7 +43,7 @@ public:
 
 	// This function is time critical
 	// So force it inlined
-	inline int nextState(int original, int neighbourCount)
+	inline int nextState(int original, int neighbourCount) const
 	{
 		if (original)
 			return TEST_BIT(s, neighbourCount) > 0;
@@ -49,8 +51,42 @@ public:
 			return TEST_BIT(b, neighbourCount) > 0;
 	}
 
+	// Bit-sliced version of nextState for 64 cells at once, or more with vector types
+	// count0 to count3 are the bit planes of the neighbour counts
+	template <typename W>
+	ALWAYS_INLINE W nextStates(W original, W count0, W count1, W count2, W count3) const
+	{
+		W planes[4][2] = {{~count0, count0}, {~count1, count1}, {~count2, count2}, {~count3, count3}};
+		W ret = original ^ original;
+		// Only the counts of the rule are looked at, 2 of them for Conway's Life
+		for (int i = 0; i < m_matchCount; i++)
+		{
+			const Match &m = m_matches[i];
+			W match = planes[0][m.count & 1] & planes[1][(m.count >> 1) & 1]
+					& planes[2][(m.count >> 2) & 1] & planes[3][(m.count >> 3) & 1];
+			if (!m.born)
+				match &= original;
+			else if (!m.survive)
+				match &= ~original;
+			ret |= match;
+		}
+		return ret;
+	}
+
 private:
+	/// A neighbour count giving birth to dead cells, keeping alive cells, or both
+	struct Match
+	{
+		int count;
+		bool born, survive;
+	};
+
+	void compile();
+
 	int b, s;
+	// Compiled from b and s by setB() and setS()
+	Match m_matches[9];
+	int m_matchCount;
 };
 
 #endif
@@ -0,0 +1,75 @@
+/*
+ *   Copyright (C) 2011 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "TileCache.h"
+
+uint qHash(const TileCache::Key &key)
+{
+	return key.x.lowbits<uint>(32) * 31 + key.y.lowbits<uint>(32) * 17 + key.scale;
+}
+
+TileCache::TileCache(QObject *parent)
+	: QObject(parent), m_frame(0)
+{
+}
+
+TileCache::~TileCache()
+{
+	clear();
+}
+
+QRgb *TileCache::tile(const BigInteger &x, const BigInteger &y, int scale)
+{
+	Tile *tile = m_tiles.value(Key(x, y, scale));
+	if (!tile)
+		return NULL;
+	tile->frame = m_frame;
+	return tile->data;
+}
+
+QRgb *TileCache::newTile(const BigInteger &x, const BigInteger &y, int scale)
+{
+	if (m_tiles.size() >= MAX_TILES)
+		evict();
+	Tile *tile = new Tile;
+	tile->frame = m_frame;
+	m_tiles.insert(Key(x, y, scale), tile);
+	return tile->data;
+}
+
+void TileCache::clear()
+{
+	foreach (Tile *tile, m_tiles)
+		delete tile;
+	m_tiles.clear();
+}
+
+// A frame larger than the cache keeps all its tiles
+void TileCache::evict()
+{
+	QHash<Key, Tile *>::iterator i = m_tiles.begin();
+	while (i != m_tiles.end())
+		if (i.value()->frame != m_frame)
+		{
+			delete i.value();
+			i = m_tiles.erase(i);
+		}
+		else
+			++i;
+}
@@ -0,0 +1,88 @@
+/*
+ *   Copyright (C) 2011 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <QHash>
+#include <QObject>
+#include <QRgb>
+
+#include "BigInteger.h"
+
+/// Rendered tiles of the universe, reused by the frames painted until the grid changes
+// A tile holds TILE_SIZE x TILE_SIZE grids of a scale, tile (x, y) starting
+// at grid (x, y) << TILE_BITS. Tiles not used by the current frame are
+// evicted once there are MAX_TILES of them.
+class TileCache: public QObject
+{
+	Q_OBJECT
+
+public:
+	static const int TILE_BITS = 6;
+	static const int TILE_SIZE = 1 << TILE_BITS;
+
+	TileCache(QObject *parent = 0);
+	virtual ~TileCache();
+
+	/// Called before the tiles of a frame are looked up
+	void beginFrame() { m_frame++; }
+	/// The pixels of a tile, row by row, NULL if it is not rendered
+	QRgb *tile(const BigInteger &x, const BigInteger &y, int scale);
+	/// Adds a tile to be rendered by the caller
+	QRgb *newTile(const BigInteger &x, const BigInteger &y, int scale);
+
+public slots:
+	void clear();
+
+private:
+	static const int MAX_TILES = 2048;
+
+	struct Key
+	{
+		Key(const BigInteger &x, const BigInteger &y, int scale)
+			: x(x), y(y), scale(scale)
+		{
+		}
+
+		inline bool operator == (const Key &key) const
+		{
+			return scale == key.scale && x == key.x && y == key.y;
+		}
+
+		BigInteger x, y;
+		int scale;
+	};
+
+	struct Tile
+	{
+		QRgb data[TILE_SIZE * TILE_SIZE];
+		// The last frame using it
+		int frame;
+	};
+
+	friend uint qHash(const Key &key);
+
+	void evict();
+
+	QHash<Key, Tile *> m_tiles;
+	int m_frame;
+};
+
+#endif
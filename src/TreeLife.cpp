@@ -18,9 +18,12 @@
  */
 
 #include <QMutex>
+#include <QRunnable>
+#include <QThreadPool>
 
 #include "AlgorithmManager.h"
 #include "CanvasPainter.h"
+#include "LifeKernel.h"
 #include "RuleLife.h"
 #include "TreeLife.h"
 #include "TreeUtils.h"
@@ -36,7 +39,10 @@
 #define LEFT_CHANGED  4  // The left column has changed since last iteration
 #define RIGHT_CHANGED 5  // The right column has changed since last iteration
 
-struct Block
+typedef TreeLife::Block Block;
+typedef TreeLife::Node Node;
+
+struct TreeLife::Block
 {
 public:
 	static const size_t DEPTH = 3;
@@ -73,6 +79,16 @@ public:
 		return (data >> (y * Block::SIZE)) & (BIT(Block::SIZE, quint64) - 1);
 	}
 
+	inline quint64 getData() const
+	{
+		return data;
+	}
+
+	inline void setData(quint64 newData)
+	{
+		data = newData;
+	}
+
 private:
 	quint64 data;
 };
@@ -83,7 +99,7 @@ private:
 #define ur child[1]
 #define dl child[2]
 #define dr child[3]
-struct Node
+struct TreeLife::Node
 {
 	Node *child[4];
 	int flag;
@@ -95,8 +111,44 @@ struct Node
 	}
 };
 
+class TreeLifeWorker: public QRunnable
+{
+public:
+	TreeLifeWorker(TreeLife *algorithm, bool deleting)
+		: m_algorithm(algorithm), m_deleting(deleting)
+	{
+	}
+
+	virtual void run()
+	{
+		m_algorithm->workTasks(MemoryManager::local(), m_deleting);
+	}
+
+private:
+	TreeLife *m_algorithm;
+	bool m_deleting;
+};
+
+/// Deletes the garbage its readers might still reach along with it
+struct TreeLifeSnapshot: public Snapshot
+{
+	TreeLifeSnapshot(TreeLife *algorithm)
+		: algorithm(algorithm)
+	{
+	}
+
+	virtual ~TreeLifeSnapshot()
+	{
+		algorithm->deleteGarbage(garbage);
+	}
+
+	TreeLife *algorithm;
+	QVector<TreeLife::Garbage> garbage;
+};
+
 TreeLife::TreeLife()
-	: m_running(false), m_readLock(new QMutex()), m_writeLock(new QMutex()), m_x(0), m_y(0), m_generation(0)
+	: m_running(false), m_rule(NULL), m_writeLock(new QMutex()), m_x(0), m_y(0), m_generation(0),
+	  m_threadCount(QThread::idealThreadCount()), m_threadPool(new QThreadPool()), ms_w(0), ms_h(0)
 {
 	setAcceptInfinity(false);
 	m_emptyNode.resize(Block::DEPTH + 1);
@@ -107,11 +159,14 @@ TreeLife::TreeLife()
 	// run() requires m_depth >= Block::DEPTH + 2
 	m_depth = Block::DEPTH + 2;
 	m_root = newNode(m_depth);
+	publish();
 }
 
 TreeLife::~TreeLife()
 {
-	delete m_readLock;
+	// The garbage is deleted on the thread pool
+	clearSnapshots();
+	delete m_threadPool;
 	delete m_writeLock;
 	deleteNode(m_root, m_depth);
 	for (int i = Block::DEPTH; i < m_emptyNode.size(); i++)
@@ -129,7 +184,6 @@ void TreeLife::setReceiveRect(const BigInteger &x, const BigInteger &y, quint64
 void TreeLife::receive(DataChannel *channel)
 {
 	m_writeLock->lock();
-	m_readLock->lock();
 	// out of range
 	// TODO: optimization
 	BigInteger x1 = mc_x - m_x, y1 = mc_y - m_y, x2 = x1 + BigInteger(mc_w - 1), y2 = y1 + BigInteger(mc_h - 1);
@@ -145,7 +199,7 @@ void TreeLife::receive(DataChannel *channel)
 	size_t endDepth = qMax<size_t>(qMax(bitlen(mc_w), bitlen(mc_h)), Block::DEPTH);
 	Node *e = emptyNode(m_depth);
 	receiveGrid(channel, m_root, e, e, e, false, false, false, m_depth, endDepth, x1, y1);
-	m_readLock->unlock();
+	publish();
 	m_writeLock->unlock();
 	emit gridChanged();
 }
@@ -181,15 +235,13 @@ void TreeLife::receiveGrid(DataChannel *channel, Node *&node_ul, Node *&node_ur,
 	}
 	else
 	{
-		Node *e = emptyNode(depth);
-		if (node_ul == e)
-			node_ul = newNode(depth);
-		if (node_ur == e && ok_ur)
-			node_ur = newNode(depth);
-		if (node_dl == e && ok_dl)
-			node_dl = newNode(depth);
-		if (node_dr == e && ok_dr)
-			node_dr = newNode(depth);
+		node_ul = copyNode(node_ul, depth);
+		if (ok_ur)
+			node_ur = copyNode(node_ur, depth);
+		if (ok_dl)
+			node_dl = copyNode(node_dl, depth);
+		if (ok_dr)
+			node_dr = copyNode(node_dr, depth);
 		switch ((y.bit(depth - 1) << 1) | x.bit(depth - 1))
 		{
 		case 0:
@@ -239,7 +291,7 @@ inline void TreeLife::receiveGrid(DataChannel *channel, Node *&node_ul, Node *&n
 		if (x < len)
 		{
 			receiveGrid(channel, node_ul, depth, x, y, state, cnt);
-			if (state >= 0)
+			if (DataChannel::isCells(state))
 				receiveGrid(channel, node_ur, depth, 0, y, state, cnt);
 		}
 		else
@@ -250,7 +302,7 @@ inline void TreeLife::receiveGrid(DataChannel *channel, Node *&node_ul, Node *&n
 		if (x < len)
 		{
 			receiveGrid(channel, node_dl, depth, x, y - len, state, cnt);
-			if (state >= 0)
+			if (DataChannel::isCells(state))
 				receiveGrid(channel, node_dr, depth, 0, y - len, state, cnt);
 		}
 		else
@@ -264,53 +316,53 @@ void TreeLife::receiveGrid(DataChannel *channel, Node *&node, size_t depth, quin
 	{
 		do
 		{
-			quint64 d = qMin<quint64>(Block::SIZE - x, cnt);
-			if (state)
+			quint64 d = qMin<quint64>(Block::SIZE - x, DataChannel::cellCount(state, cnt));
+			// Received cells are only ever added, a whole row piece at once
+			quint64 bits = DataChannel::cellBits(state, cnt, d) << (y * Block::SIZE + x);
+			if (bits)
 			{
-				if (node == emptyNode(depth))
-					node = reinterpret_cast<Node *>(newBlock());
+				node = copyNode(node, depth);
 				Block *block = reinterpret_cast<Block *>(node);
-				for (unsigned int i = x; i < x + d; i++)
-					if (block->get(i, y) != state)
-					{
-						if (!block->get(i, y))
-							block->population++;
-						else
-							block->population--;
-						block->set(i, y, state);
-						if (y == 0)
-							SET_BIT(block->flag, UP_CHANGED);
-						if (y == Block::SIZE - 1)
-							SET_BIT(block->flag, DOWN_CHANGED);
-						if (i == 0)
-							SET_BIT(block->flag, LEFT_CHANGED);
-						if (i == Block::SIZE - 1)
-							SET_BIT(block->flag, RIGHT_CHANGED);
-					}
+				quint64 born = bits & ~block->getData();
+				if (born)
+				{
+					block->setData(block->getData() | born);
+					block->population += popCount(born);
+					if (born & Q_UINT64_C(0x00000000000000FF))
+						SET_BIT(block->flag, UP_CHANGED);
+					if (born & Q_UINT64_C(0xFF00000000000000))
+						SET_BIT(block->flag, DOWN_CHANGED);
+					if (born & Q_UINT64_C(0x0101010101010101))
+						SET_BIT(block->flag, LEFT_CHANGED);
+					if (born & Q_UINT64_C(0x8080808080808080))
+						SET_BIT(block->flag, RIGHT_CHANGED);
+				}
 				SET_BIT(block->flag, CHANGED);
 			}
-			cnt -= d;
-			if (!cnt)
+			DataChannel::skipCells(state, cnt, d);
+			if (!DataChannel::cellCount(state, cnt))
 				channel->receive(&state, &cnt);
 			x += d;
 		}
-		while (x < Block::SIZE && state >= 0);
+		while (x < Block::SIZE && DataChannel::isCells(state));
 	}
 	else
 	{
 		quint64 len = Q_UINT64_C(1) << depth;
-		while (x < len && state == 0)
+		// Skip the dead cells without creating nodes for them
+		while (x < len && DataChannel::isCells(state))
 		{
-			quint64 d = qMin(len - x, cnt);
-			cnt -= d;
-			if (!cnt)
+			quint64 d = qMin(len - x, DataChannel::cellCount(state, cnt));
+			if (DataChannel::cellBits(state, cnt, qMin<quint64>(d, DataChannel::BITS_PER_ENTRY)))
+				break;
+			DataChannel::skipCells(state, cnt, d);
+			if (!DataChannel::cellCount(state, cnt))
 				channel->receive(&state, &cnt);
 			x += d;
 		}
-		if (x < len && state > 0)
+		if (x < len && DataChannel::isCells(state))
 		{
-			if (node == emptyNode(depth))
-				node = newNode(depth);
+			node = copyNode(node, depth);
 			receiveGrid(channel, node->ul, node->ur, node->dl, node->dr, depth - 1, x, y, state, cnt);
 			computeNodeInfo(node, depth);
 		}
@@ -319,29 +371,25 @@ void TreeLife::receiveGrid(DataChannel *channel, Node *&node, size_t depth, quin
 
 int TreeLife::grid(const BigInteger &x, const BigInteger &y)
 {
-	m_readLock->lock();
-	BigInteger my_x = x - m_x, my_y = y - m_y;
+	int slot;
+	const Snapshot *snapshot = acquireSnapshot(&slot);
+	BigInteger my_x = x - snapshot->x, my_y = y - snapshot->y;
+	int ret = 0;
 	// out of range
-	if (my_x.sgn() < 0 || my_x.bitCount() > m_depth || my_y.sgn() < 0 || my_y.bitCount() > m_depth)
+	if (my_x.sgn() >= 0 && my_x.bitCount() <= snapshot->depth && my_y.sgn() >= 0 && my_y.bitCount() <= snapshot->depth)
 	{
-		m_readLock->unlock();
-		return 0;
-	}
-	Node *p = m_root;
-	size_t depth = m_depth;
-	while (depth > Block::DEPTH)
-	{
-		if (p == emptyNode(depth))
-			break;
-		p = p->child[(my_y.bit(depth - 1) << 1) | my_x.bit(depth - 1)];
-		depth--;
+		Node *p = static_cast<Node *>(snapshot->root);
+		size_t depth = snapshot->depth;
+		// Empty nodes hold no block
+		while (depth > Block::DEPTH && p->population)
+		{
+			p = p->child[(my_y.bit(depth - 1) << 1) | my_x.bit(depth - 1)];
+			depth--;
+		}
+		if (depth == Block::DEPTH)
+			ret = reinterpret_cast<Block *>(p)->get(my_x.lowbits<int>(Block::DEPTH), my_y.lowbits<int>(Block::DEPTH));
 	}
-	int ret;
-	if (p == NULL)
-		ret = 0;
-	else
-		ret = reinterpret_cast<Block *>(p)->get(my_x.lowbits<int>(Block::DEPTH), my_y.lowbits<int>(Block::DEPTH));
-	m_readLock->unlock();
+	releaseSnapshot(slot);
 	return ret;
 }
 
@@ -359,21 +407,16 @@ void TreeLife::setGrid(const BigInteger &x, const BigInteger &y, int state)
 		my_x = x - m_x;
 		my_y = y - m_y;
 	}
-    Node *p = m_root, **stack = new Node *[m_depth + 1];
+	// The path down to the cell is copied, the rest of the tree is shared with the snapshot
+	m_root = copyNode(m_root, m_depth);
+	Node *p = m_root, **stack = new Node *[m_depth + 1];
 	size_t depth = m_depth;
 	while (depth > Block::DEPTH)
 	{
 		stack[depth] = p;
 		int cid = (my_y.bit(depth - 1) << 1) | my_x.bit(depth - 1);
 		depth--;
-		if (p->child[cid] == emptyNode(depth))
-		{
-			if (depth == Block::DEPTH)
-				p->child[cid] = reinterpret_cast<Node *>(newBlock());
-			else
-				p->child[cid] = newNode(depth);
-		}
-		p = p->child[cid];
+		p = p->child[cid] = copyNode(p->child[cid], depth);
 	}
 	Block *block = reinterpret_cast<Block *>(p);
 	int sx = my_x.lowbits<int>(Block::DEPTH), sy = my_y.lowbits<int>(Block::DEPTH);
@@ -392,8 +435,9 @@ void TreeLife::setGrid(const BigInteger &x, const BigInteger &y, int state)
 	if (sx == Block::SIZE - 1)
 		SET_BIT(block->flag, RIGHT_CHANGED);
 	while (++depth <= m_depth)
-        computeNodeInfo(stack[depth], depth);
-    delete stack;
+		computeNodeInfo(stack[depth], depth);
+	delete [] stack;
+	publish();
 	m_writeLock->unlock();
 	emit gridChanged();
 }
@@ -401,31 +445,34 @@ void TreeLife::setGrid(const BigInteger &x, const BigInteger &y, int state)
 void TreeLife::clearGrid()
 {
 	m_writeLock->lock();
-	m_readLock->lock();
-	deleteNode(m_root->ul, m_depth - 1);
-	deleteNode(m_root->ur, m_depth - 1);
-	deleteNode(m_root->dl, m_depth - 1);
-	deleteNode(m_root->dr, m_depth - 1);
+	retire(m_root, m_depth, false);
 	m_depth = Block::DEPTH + 2;
-	m_root->ul = m_root->ur = m_root->dl = m_root->dr = emptyNode(m_depth - 1);
-	m_root->flag = 0;
-	m_root->population = 0;
+	m_root = newNode(m_depth);
 	m_x = 0;
 	m_y = 0;
 	m_generation = 0;
-	m_readLock->unlock();
+	publish();
+	// Only the memory of deleted nodes can be released
+	reclaimSnapshots(true);
+	MemoryManager::releaseMemory();
 	m_writeLock->unlock();
 	emit gridChanged();
 }
 
 BigInteger TreeLife::generation() const
 {
-	return m_generation;
+	int slot;
+	BigInteger ret = acquireSnapshot(&slot)->generation;
+	releaseSnapshot(slot);
+	return ret;
 }
 
 BigInteger TreeLife::population() const
 {
-	return m_root->population;
+	int slot;
+	BigInteger ret = static_cast<Node *>(acquireSnapshot(&slot)->root)->population;
+	releaseSnapshot(slot);
+	return ret;
 }
 
 void TreeLife::rectChange(const BigInteger &, const BigInteger &, const BigInteger &, const BigInteger &)
@@ -434,33 +481,25 @@ void TreeLife::rectChange(const BigInteger &, const BigInteger &, const BigInteg
 	clearGrid();
 }
 
+// Readers may be in the root, so it is replaced rather than changed
 void TreeLife::expand()
 {
-	{
-		Node *tmp = newNode(m_depth);
-		tmp->dr = m_root->ul;
-		m_root->ul = tmp;
-	}
-	{
-		Node *tmp = newNode(m_depth);
-		tmp->dl = m_root->ur;
-		m_root->ur = tmp;
-	}
-	{
-		Node *tmp = newNode(m_depth);
-		tmp->ur = m_root->dl;
-		m_root->dl = tmp;
-	}
-	{
-		Node *tmp = newNode(m_depth);
-		tmp->ul = m_root->dr;
-		m_root->dr = tmp;
-	}
-	computeNodeInfo(m_root->ul, m_depth);
-	computeNodeInfo(m_root->ur, m_depth);
-	computeNodeInfo(m_root->dl, m_depth);
-	computeNodeInfo(m_root->dr, m_depth);
-	computeNodeInfo(m_root, m_depth + 1);
+	Node *root = newNode(m_depth + 1);
+	root->ul = newNode(m_depth);
+	root->ul->dr = m_root->ul;
+	root->ur = newNode(m_depth);
+	root->ur->dl = m_root->ur;
+	root->dl = newNode(m_depth);
+	root->dl->ur = m_root->dl;
+	root->dr = newNode(m_depth);
+	root->dr->ul = m_root->dr;
+	computeNodeInfo(root->ul, m_depth);
+	computeNodeInfo(root->ur, m_depth);
+	computeNodeInfo(root->dl, m_depth);
+	computeNodeInfo(root->dr, m_depth);
+	computeNodeInfo(root, m_depth + 1);
+	retire(m_root, m_depth, true);
+	m_root = root;
 	BigInteger offset = BigInteger::exp2(m_depth - 1);
 	m_x -= offset;
 	m_y -= offset;
@@ -504,18 +543,18 @@ inline void TreeLife::computeNodeInfo(Node *node, size_t depth)
 	node->flag |= TEST_BIT(dr_flag, RIGHT_CHANGED);
 }
 
-inline Block *TreeLife::newBlock()
+inline Block *TreeLife::newBlock(MemoryManager *memoryManager)
 {
-	Block *ret = newObject<Block>();
+	Block *ret = memoryManager->newObject<Block>();
 	ret->clear();
 	ret->flag = 0;
 	ret->population = 0;
 	return ret;
 }
 
-inline Node *TreeLife::newNode(size_t depth)
+inline Node *TreeLife::newNode(size_t depth, MemoryManager *memoryManager)
 {
-	Node *ret = newObject<Node>();
+	Node *ret = memoryManager->newObject<Node>();
 	ret->ul = ret->ur = ret->dl = ret->dr = emptyNode(depth - 1);
 	ret->flag = 0;
 	ret->population = 0;
@@ -533,9 +572,40 @@ Node *&TreeLife::emptyNode(size_t depth)
 	}
 }
 
-void TreeLife::deleteNode(Node *node, size_t depth)
+/// A node of the edit in progress to change in place of node, which is retired if in a snapshot
+// Only the copy is changed, so readers of the snapshots never see a node
+// changing under them; a node copied once is changed in place afterwards.
+Node *TreeLife::copyNode(Node *node, size_t depth)
 {
-	if (node == emptyNode(depth))
+	if (m_edited.contains(node))
+		return node;
+	Node *ret;
+	if (depth == Block::DEPTH)
+	{
+		Block *block = newBlock();
+		if (node != emptyNode(depth))
+			*block = *reinterpret_cast<Block *>(node);
+		// The copy is in no other tree
+		CLR_BIT(block->flag, KEEP);
+		ret = reinterpret_cast<Node *>(block);
+	}
+	else
+	{
+		ret = newNode(depth);
+		if (node != emptyNode(depth))
+			*ret = *node;
+		CLR_BIT(ret->flag, KEEP);
+	}
+	if (node != emptyNode(depth))
+		retire(node, depth, true);
+	m_edited.insert(ret);
+	return ret;
+}
+
+// Nodes are freed to memoryManager, and nodes at stopDepth are left to the caller
+void TreeLife::deleteNode(Node *node, size_t depth, MemoryManager *memoryManager, size_t stopDepth)
+{
+	if (node == emptyNode(depth) || depth == stopDepth)
 		return;
 	if (depth == Block::DEPTH)
 	{
@@ -543,141 +613,313 @@ void TreeLife::deleteNode(Node *node, size_t depth)
 		if (TEST_BIT(bnode->flag, KEEP))
 			CLR_BIT(bnode->flag, KEEP);
 		else
-			deleteObject(bnode);
+			memoryManager->deleteObject(bnode);
 	}
 	else if (TEST_BIT(node->flag, KEEP))
 		CLR_BIT(node->flag, KEEP);
 	else
 	{
-		deleteNode(node->ul, depth - 1);
-		deleteNode(node->ur, depth - 1);
-		deleteNode(node->dl, depth - 1);
-		deleteNode(node->dr, depth - 1);
-		deleteObject(node);
+		deleteNode(node->ul, depth - 1, memoryManager, stopDepth);
+		deleteNode(node->ur, depth - 1, memoryManager, stopDepth);
+		deleteNode(node->dl, depth - 1, memoryManager, stopDepth);
+		deleteNode(node->dr, depth - 1, memoryManager, stopDepth);
+		memoryManager->deleteObject(node);
+	}
+}
+
+/// Leaves node, with its whole tree unless single, to be deleted once no reader can reach it
+void TreeLife::retire(Node *node, size_t depth, bool single)
+{
+	Garbage garbage = {node, depth, single, QVector<Node *>(), 0};
+	m_garbage.append(garbage);
+}
+
+// Deleted in the order retired, as a step's garbage clears the KEEP flags
+// its subtrees shared with the next generation before they are deleted
+void TreeLife::deleteGarbage(const QVector<Garbage> &garbage)
+{
+	for (int i = 0; i < garbage.size(); i++)
+	{
+		const Garbage &g = garbage[i];
+		if (g.single && g.depth == Block::DEPTH)
+			deleteObject(reinterpret_cast<Block *>(g.node));
+		else if (g.single)
+			deleteObject(g.node);
+		else if (g.tasks.isEmpty())
+			deleteNode(g.node, g.depth);
+		else
+		{
+			m_tasks.clear();
+			for (int j = 0; j < g.tasks.size(); j++)
+			{
+				RunNodeTask task = {NULL, g.tasks[j]};
+				m_tasks.append(task);
+			}
+			m_taskDepth = g.taskDepth;
+			runTasks(m_threadCount, true);
+			deleteNode(g.node, g.depth, this, g.taskDepth);
+		}
 	}
 }
 
+/// Makes the current tree the snapshot readers acquire
+void TreeLife::publish()
+{
+	TreeLifeSnapshot *snapshot = new TreeLifeSnapshot(this);
+	snapshot->root = m_root;
+	snapshot->emptyNode = emptyNode(m_depth);
+	snapshot->depth = m_depth;
+	snapshot->x = m_x;
+	snapshot->y = m_y;
+	snapshot->generation = m_generation;
+	// Readers of the previous snapshot may still be in the garbage
+	TreeLifeSnapshot *previous = static_cast<TreeLifeSnapshot *>(AbstractAlgorithm::snapshot());
+	if (previous)
+		previous->garbage += m_garbage;
+	else
+		deleteGarbage(m_garbage);
+	m_garbage.clear();
+	m_edited.clear();
+	publishSnapshot(snapshot);
+}
+
 void TreeLife::paint(CanvasPainter *painter, const BigInteger &x, const BigInteger &y, int w, int h, size_t scale)
 {
-	m_readLock->lock();
-	treePaint<TreeLife, Block, Node>(this, painter, x, y, w, h, scale, m_x, m_y, m_depth, m_root, emptyNode(m_depth));
-	m_readLock->unlock();
+	int slot;
+	const Snapshot *snapshot = acquireSnapshot(&slot);
+	treePaint<TreeLife, Block, Node>(this, painter, x, y, w, h, scale, snapshot->x, snapshot->y, snapshot->depth, static_cast<Node *>(snapshot->root), static_cast<Node *>(snapshot->emptyNode));
+	releaseSnapshot(slot);
+}
+
+bool TreeLife::boundingRect(BigInteger *x, BigInteger *y, quint64 *w, quint64 *h)
+{
+	int slot;
+	const Snapshot *snapshot = acquireSendSnapshot(&slot);
+	bool ret = treeBoundingRect<TreeLife, Block, Node>(this, x, y, w, h, snapshot->x, snapshot->y, snapshot->depth, static_cast<Node *>(snapshot->root));
+	releaseSnapshot(slot);
+	return ret;
 }
 
-void TreeLife::runStep()
+void TreeLife::setSendRect(const BigInteger &x, const BigInteger &y, quint64 w, quint64 h)
 {
-	start();
+	ms_x = x;
+	ms_y = y;
+	ms_w = w;
+	ms_h = h;
 }
 
-void TreeLife::runNode(Node *&p, Node *node, Node *up, Node *down, Node *left, Node *right, Node *upleft, Node *upright, Node *downleft, Node *downright, size_t depth)
+// Only the nodes holding live cells are visited
+void TreeLife::send(DataChannel *channel)
 {
-	if (depth == Block::DEPTH)
+	int slot;
+	const Snapshot *snapshot = acquireSendSnapshot(&slot);
+	treeSend<TreeLife, Block, Node>(this, channel, ms_x, ms_y, ms_w, ms_h, snapshot->x, snapshot->y, snapshot->depth, static_cast<Node *>(snapshot->root), static_cast<Node *>(snapshot->emptyNode));
+	releaseSnapshot(slot);
+}
+
+void TreeLife::setRule(Rule *rule)
+{
+	m_writeLock->lock();
+	m_rule = reinterpret_cast<RuleLife *>(rule);
+	m_writeLock->unlock();
+}
+
+// Whether the node or the edges of its neighbours next to it have changed
+template <typename T>
+static inline bool needsStep(T *node, T *up, T *down, T *left, T *right, T *upleft, T *upright, T *downleft, T *downright)
+{
+	return TEST_BIT(node->flag, CHANGED)
+			|| TEST_BIT(up->flag, DOWN_CHANGED)
+			|| TEST_BIT(down->flag, UP_CHANGED)
+			|| TEST_BIT(left->flag, RIGHT_CHANGED)
+			|| TEST_BIT(right->flag, LEFT_CHANGED)
+			|| (TEST_BIT(upleft->flag, DOWN_CHANGED) && TEST_BIT(upleft->flag, RIGHT_CHANGED))
+			|| (TEST_BIT(upright->flag, DOWN_CHANGED) && TEST_BIT(upright->flag, LEFT_CHANGED))
+			|| (TEST_BIT(downleft->flag, UP_CHANGED) && TEST_BIT(downleft->flag, RIGHT_CHANGED))
+			|| (TEST_BIT(downright->flag, UP_CHANGED) && TEST_BIT(downright->flag, LEFT_CHANGED));
+}
+
+// New nodes come from memoryManager, which belongs to the calling thread.
+// Every call only reads the old tree and writes its own new subtree and the
+// KEEP flag of node, so calls on different subtrees may run in parallel.
+void TreeLife::runNode(Node *&p, Node *node, Node *up, Node *down, Node *left, Node *right, Node *upleft, Node *upright, Node *downleft, Node *downright, size_t depth, MemoryManager *memoryManager)
+{
+	if (needsStep(node, up, down, left, right, upleft, upright, downleft, downright))
 	{
-		Block *bnode = reinterpret_cast<Block *>(node);
-		Block *bup = reinterpret_cast<Block *>(up);
-		Block *bdown = reinterpret_cast<Block *>(down);
-		Block *bleft = reinterpret_cast<Block *>(left);
-		Block *bright = reinterpret_cast<Block *>(right);
-		Block *bupleft = reinterpret_cast<Block *>(upleft);
-		Block *bupright = reinterpret_cast<Block *>(upright);
-		Block *bdownleft = reinterpret_cast<Block *>(downleft);
-		Block *bdownright = reinterpret_cast<Block *>(downright);
-		if (TEST_BIT(reinterpret_cast<Block *>(node)->flag, CHANGED)
-				|| TEST_BIT(bup->flag, DOWN_CHANGED)
-				|| TEST_BIT(bdown->flag, UP_CHANGED)
-				|| TEST_BIT(bleft->flag, RIGHT_CHANGED)
-				|| TEST_BIT(bright->flag, LEFT_CHANGED)
-				|| (TEST_BIT(bupleft->flag, DOWN_CHANGED) && TEST_BIT(bupleft->flag, RIGHT_CHANGED))
-				|| (TEST_BIT(bupright->flag, DOWN_CHANGED) && TEST_BIT(bupright->flag, LEFT_CHANGED))
-				|| (TEST_BIT(bdownleft->flag, UP_CHANGED) && TEST_BIT(bdownleft->flag, RIGHT_CHANGED))
-				|| (TEST_BIT(bdownright->flag, UP_CHANGED) && TEST_BIT(bdownright->flag, LEFT_CHANGED)))
+		p = newNode(depth, memoryManager);
+		if (depth == Block::DEPTH + 1)
+			runBlocks(p, node, up, down, left, right, upleft, upright, downleft, downright, memoryManager);
+		else
 		{
-			Block *block = newBlock();
-			p = reinterpret_cast<Node *>(block);
-			const int dx[8] = {-1,  0,  1, 1, 1, 0, -1, -1};
-			const int dy[8] = {-1, -1, -1, 0, 1, 1,  1,  0};
-			quint64 data[Block::SIZE + 2];
-			data[0] = (bupright->get(0, Block::SIZE - 1) << (Block::SIZE + 1)) | (bup->getRow(Block::SIZE - 1) << 1) | bupleft->get(Block::SIZE - 1, Block::SIZE - 1);
-			for (size_t i = 0; i < Block::SIZE; i++)
-				data[i + 1] = (bright->get(0, i) << (Block::SIZE + 1)) | (bnode->getRow(i) << 1) | bleft->get(Block::SIZE - 1, i);
-			data[Block::SIZE + 1] = (bdownright->get(0, 0) << (Block::SIZE + 1)) | (bdown->getRow(0) << 1) | bdownleft->get(Block::SIZE - 1, 0);
-			for (size_t x = 0; x < Block::SIZE; x++)
-				for (size_t y = 0; y < Block::SIZE; y++)
-				{
-					int n = 0;
-					for (int d = 0; d < 8; d++)
-						n += TEST_BIT(data[y + 1 + dy[d]], x + 1 + dx[d]) > 0;
-					block->set(x, y, reinterpret_cast<RuleLife *>(AlgorithmManager::rule())->nextState(bnode->get(x, y), n));
-					block->population += block->get(x, y) > 0;
-					if (block->get(x, y) != bnode->get(x, y))
-					{
-						if (y == 0)
-							SET_BIT(block->flag, UP_CHANGED);
-						if (y == Block::SIZE - 1)
-							SET_BIT(block->flag, DOWN_CHANGED);
-						if (x == 0)
-							SET_BIT(block->flag, LEFT_CHANGED);
-						if (x == Block::SIZE - 1)
-							SET_BIT(block->flag, RIGHT_CHANGED);
-						SET_BIT(block->flag, CHANGED);
-					}
-				}
+			runNode(p->ul, node->ul, up->dl, node->dl, left->ur, node->ur, upleft->dr, up->dr, left->dr, node->dr, depth - 1, memoryManager);
+			runNode(p->ur, node->ur, up->dr, node->dr, node->ul, right->ul, up->dl, upright->dl, node->dl, right->dl, depth - 1, memoryManager);
+			runNode(p->dl, node->dl, node->ul, down->ul, left->dr, node->dr, left->ur, node->ur, downleft->ur, down->ur, depth - 1, memoryManager);
+			runNode(p->dr, node->dr, node->ur, down->ur, node->dl, right->dl, node->ul, right->ul, down->ul, downright->ul, depth - 1, memoryManager);
 		}
-		else if (node != emptyNode(depth))
+		computeNodeInfo(p, depth);
+	}
+	else if (node != emptyNode(depth))
+	{
+		SET_BIT(node->flag, KEEP);
+		p = node;
+	}
+}
+
+// Steps the 4 blocks of node, which is at depth Block::DEPTH + 1, with a single stepBlocks() call
+void TreeLife::runBlocks(Node *p, Node *node, Node *up, Node *down, Node *left, Node *right, Node *upleft, Node *upright, Node *downleft, Node *downright, MemoryManager *memoryManager)
+{
+	// The 9 neighbourhood blocks of each child, in the order of runNode() parameters
+	Node *nodes[4][9] = {
+		{node->ul, up->dl, node->dl, left->ur, node->ur, upleft->dr, up->dr, left->dr, node->dr},
+		{node->ur, up->dr, node->dr, node->ul, right->ul, up->dl, upright->dl, node->dl, right->dl},
+		{node->dl, node->ul, down->ul, left->dr, node->dr, left->ur, node->ur, downleft->ur, down->ur},
+		{node->dr, node->ur, down->ur, node->dl, right->dl, node->ul, right->ul, down->ul, downright->ul}
+	};
+	quint64 in[9][BLOCK_LANES], out[BLOCK_LANES];
+	Block *around[4][9];
+	int lane[4], count = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		Block **a = around[i];
+		for (int k = 0; k < 9; k++)
+			a[k] = reinterpret_cast<Block *>(nodes[i][k]);
+		if (needsStep(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8]))
 		{
-			SET_BIT(bnode->flag, KEEP);
-			p = node;
+			for (int k = 0; k < 9; k++)
+				in[k][count] = a[k]->getData();
+			lane[i] = count++;
 		}
+		else
+			lane[i] = -1;
 	}
-	else
+	for (int k = 0; k < 9; k++)
+		for (int i = count; i < BLOCK_LANES; i++)
+			in[k][i] = 0;
+	stepBlocks(m_rule, count, in, out);
+	for (int i = 0; i < 4; i++)
 	{
-		if (TEST_BIT(node->flag, CHANGED)
-				|| TEST_BIT(up->flag, DOWN_CHANGED)
-				|| TEST_BIT(down->flag, UP_CHANGED)
-				|| TEST_BIT(left->flag, RIGHT_CHANGED)
-				|| TEST_BIT(right->flag, LEFT_CHANGED)
-				|| (TEST_BIT(upleft->flag, DOWN_CHANGED) && TEST_BIT(upleft->flag, RIGHT_CHANGED))
-				|| (TEST_BIT(upright->flag, DOWN_CHANGED) && TEST_BIT(upright->flag, LEFT_CHANGED))
-				|| (TEST_BIT(downleft->flag, UP_CHANGED) && TEST_BIT(downleft->flag, RIGHT_CHANGED))
-				|| (TEST_BIT(downright->flag, UP_CHANGED) && TEST_BIT(downright->flag, LEFT_CHANGED)))
+		Block *original = around[i][0];
+		if (lane[i] >= 0)
 		{
-			p = newNode(depth);
-			runNode(p->ul, node->ul, up->dl, node->dl, left->ur, node->ur, upleft->dr, up->dr, left->dr, node->dr, depth - 1);
-			runNode(p->ur, node->ur, up->dr, node->dr, node->ul, right->ul, up->dl, upright->dl, node->dl, right->dl, depth - 1);
-			runNode(p->dl, node->dl, node->ul, down->ul, left->dr, node->dr, left->ur, node->ur, downleft->ur, down->ur, depth - 1);
-			runNode(p->dr, node->dr, node->ur, down->ur, node->dl, right->dl, node->ul, right->ul, down->ul, downright->ul, depth - 1);
-			computeNodeInfo(p, depth);
+			Block *block = newBlock(memoryManager);
+			p->child[i] = reinterpret_cast<Node *>(block);
+			block->setData(out[lane[i]]);
+			block->population = popCount(out[lane[i]]);
+			quint64 diff = out[lane[i]] ^ original->getData();
+			if (diff)
+			{
+				SET_BIT(block->flag, CHANGED);
+				if (diff & Q_UINT64_C(0x00000000000000FF))
+					SET_BIT(block->flag, UP_CHANGED);
+				if (diff & Q_UINT64_C(0xFF00000000000000))
+					SET_BIT(block->flag, DOWN_CHANGED);
+				if (diff & Q_UINT64_C(0x0101010101010101))
+					SET_BIT(block->flag, LEFT_CHANGED);
+				if (diff & Q_UINT64_C(0x8080808080808080))
+					SET_BIT(block->flag, RIGHT_CHANGED);
+			}
 		}
-		else if (node != emptyNode(depth))
+		else if (nodes[i][0] != emptyNode(Block::DEPTH))
 		{
-			SET_BIT(node->flag, KEEP);
-			p = node;
+			SET_BIT(original->flag, KEEP);
+			p->child[i] = nodes[i][0];
 		}
 	}
 }
 
-#include <QTime>
-void TreeLife::run()
+// Same as runNode(), but stops m_taskDepth levels above the blocks and
+// leaves the runNode() calls there to m_tasks
+void TreeLife::splitNode(Node *&p, Node *node, Node *up, Node *down, Node *left, Node *right, Node *upleft, Node *upright, Node *downleft, Node *downright, size_t depth)
+{
+	if (depth == m_taskDepth)
+	{
+		RunNodeTask task = {&p, node, up, down, left, right, upleft, upright, downleft, downright};
+		m_tasks.append(task);
+	}
+	else if (needsStep(node, up, down, left, right, upleft, upright, downleft, downright))
+	{
+		p = newNode(depth);
+		splitNode(p->ul, node->ul, up->dl, node->dl, left->ur, node->ur, upleft->dr, up->dr, left->dr, node->dr, depth - 1);
+		splitNode(p->ur, node->ur, up->dr, node->dr, node->ul, right->ul, up->dl, upright->dl, node->dl, right->dl, depth - 1);
+		splitNode(p->dl, node->dl, node->ul, down->ul, left->dr, node->dr, left->ur, node->ur, downleft->ur, down->ur, depth - 1);
+		splitNode(p->dr, node->dr, node->ur, down->ur, node->dl, right->dl, node->ul, right->ul, down->ul, downright->ul, depth - 1);
+		m_splitNodes.append(qMakePair(p, depth));
+	}
+	else if (node != emptyNode(depth))
+	{
+		SET_BIT(node->flag, KEEP);
+		p = node;
+	}
+}
+
+// Runs m_tasks on threadCount threads, or deletes the old subtrees of them
+// Pool threads allocate from and free to their MemoryManager::local(), which
+// passes surplus objects on to the others.
+void TreeLife::runTasks(int threadCount, bool deleting)
+{
+	m_nextTask = 0;
+	m_threadPool->setMaxThreadCount(threadCount - 1);
+	for (int i = 0; i < threadCount - 1; i++)
+		m_threadPool->start(new TreeLifeWorker(this, deleting));
+	workTasks(this, deleting);
+	m_threadPool->waitForDone();
+}
+
+// Run by the calling thread and every pool thread until no task is left
+void TreeLife::workTasks(MemoryManager *memoryManager, bool deleting)
+{
+	for (;;)
+	{
+		int i = m_nextTask.fetchAndAddRelaxed(1);
+		if (i >= m_tasks.size())
+			break;
+		const RunNodeTask &task = m_tasks.at(i);
+		if (deleting)
+			deleteNode(task.node, m_taskDepth, memoryManager, 0);
+		else
+			runNode(*task.p, task.node, task.up, task.down, task.left, task.right, task.upleft, task.upright, task.downleft, task.downright, m_taskDepth, memoryManager);
+	}
+}
+
+void TreeLife::setThreadCount(int count)
+{
+	m_threadCount = qMax(count, 1);
+}
+
+void TreeLife::step()
 {
-	QTime timer;
-	timer.start();
 	m_running = true;
 	m_writeLock->lock();
+	// The KEEP flags set below must not meet those the garbage of the last step still has
+	reclaimSnapshots(true);
 	if (m_root->ul->population - m_root->ul->dr->population || m_root->ur->population - m_root->ur->dl->population || m_root->dl->population - m_root->dl->ur->population || m_root->dr->population - m_root->dr->ul->population)
-	{
-		m_readLock->lock();
 		expand();
-		m_readLock->unlock();
-	}
 	Node *new_root = emptyNode(m_depth), *empty = emptyNode(m_depth);
-	runNode(new_root, m_root, empty, empty, empty, empty, empty, empty, empty, empty, m_depth);
-	m_readLock->lock();
-	deleteNode(m_root, m_depth);
+	int threadCount = m_threadCount;
+	bool parallel = threadCount > 1 && m_depth >= MIN_TASK_DEPTH + SPLIT_LEVELS;
+	if (parallel)
+	{
+		// The top levels are stepped here, the subtrees below are shared out
+		// to the threads, then the top levels get their info from the results
+		m_taskDepth = m_depth - SPLIT_LEVELS;
+		m_tasks.clear();
+		m_splitNodes.clear();
+		splitNode(new_root, m_root, empty, empty, empty, empty, empty, empty, empty, empty, m_depth);
+		runTasks(threadCount, false);
+		for (int i = 0; i < m_splitNodes.size(); i++)
+			computeNodeInfo(m_splitNodes[i].first, m_splitNodes[i].second);
+	}
+	else
+		runNode(new_root, m_root, empty, empty, empty, empty, empty, empty, empty, empty, m_depth, this);
+	// The old tree is deleted once no reader is in it, on the thread pool as well
+	Garbage garbage = {m_root, m_depth, false, QVector<Node *>(), parallel? m_taskDepth: 0};
+	if (parallel)
+		for (int i = 0; i < m_tasks.size(); i++)
+			garbage.tasks.append(m_tasks[i].node);
+	m_garbage.append(garbage);
 	m_root = new_root;
-	m_readLock->unlock();
-	m_writeLock->unlock();
 	m_generation = m_generation + 1;
+	publish();
+	m_writeLock->unlock();
 	m_running = false;
-	emit gridChanged();
-	qDebug() << timer.elapsed();
 }
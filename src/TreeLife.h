@@ -20,6 +20,9 @@
 #ifndef TreeLife_H
 #define TreeLife_H
 
+#include <QAtomicInt>
+#include <QPair>
+#include <QSet>
 #include <QVector>
 
 #include "AbstractAlgorithm.h"
@@ -27,23 +30,32 @@
 #include "MemoryManager.h"
 #include "Rule.h"
 
-struct Block;
-struct Node;
 class QMutex;
+class QThreadPool;
 class CanvasPainter;
+class RuleLife;
+class TreeLifeWorker;
 class TreeLife: public AbstractAlgorithm, private MemoryManager
 {
 	Q_OBJECT
 
 public:
+	// Defined in TreeLife.cpp, HashLife having a Block and a Node of its own
+	struct Block;
+	struct Node;
+
 	TreeLife();
 	virtual ~TreeLife();
 
 	virtual QString name() { return "TreeLife"; }
 	virtual bool acceptRule(Rule *rule) { return rule->type() == Rule::Life; }
+	virtual void setRule(Rule *rule);
 
 	virtual void setReceiveRect(const BigInteger &x, const BigInteger &y, quint64 w, quint64 h);
 	virtual void receive(DataChannel *channel);
+	virtual bool boundingRect(BigInteger *x, BigInteger *y, quint64 *w, quint64 *h);
+	virtual void setSendRect(const BigInteger &x, const BigInteger &y, quint64 w, quint64 h);
+	virtual void send(DataChannel *channel);
 	virtual int grid(const BigInteger &x, const BigInteger &y);
 	virtual void setGrid(const BigInteger &x, const BigInteger &y, int state);
 	virtual void clearGrid();
@@ -51,33 +63,88 @@ public:
 	virtual BigInteger population() const;
 	virtual void rectChange(const BigInteger &, const BigInteger &, const BigInteger &, const BigInteger &);
 	virtual void paint(CanvasPainter *canvasPainter, const BigInteger &x, const BigInteger &y, int w, int h, size_t scale);
-	virtual void runStep();
+	virtual int threadCount() const { return m_threadCount; }
+	/// Takes effect from the next step
+	virtual void setThreadCount(int count);
 
 private:
+	friend class TreeLifeWorker;
+	friend struct TreeLifeSnapshot;
+
+	/// A runNode() call left to the thread pool
+	struct RunNodeTask
+	{
+		Node **p;
+		Node *node, *up, *down, *left, *right, *upleft, *upright, *downleft, *downright;
+	};
+	/// What a step or an edit unlinked, deleted along with the last snapshot able to reach it
+	struct Garbage
+	{
+		Node *node;
+		size_t depth;
+		// Only the node itself, its children being still in use
+		bool single;
+		// Subtrees deleted on the thread pool, from taskDepth down
+		QVector<Node *> tasks;
+		size_t taskDepth;
+	};
+
+	// The step is split into tasks this many levels below the root
+	static const size_t SPLIT_LEVELS = 4;
+	// Smaller tasks are not worth running on another thread
+	static const size_t MIN_TASK_DEPTH = 7;
+
 	void receiveGrid(DataChannel *channel, Node *&node_ul, Node *&node_ur, Node *&node_dl, Node *&node_dr, bool ok_ur, bool ok_dl, bool ok_dr, size_t depth, size_t endDepth, const BigInteger &x, const BigInteger &y);
 	inline void receiveGrid(DataChannel *channel, Node *&node_ul, Node *&node_ur, Node *&node_dl, Node *&node_dr, size_t depth, quint64 x, quint64 y, int &state, quint64 &cnt);
 	void receiveGrid(DataChannel *channel, Node *&node, size_t depth, quint64 x, quint64 y, int &state, quint64 &cnt);
 	void expand();
 	inline void computeNodeInfo(Node *node, size_t depth);
-	inline Block *newBlock();
-	inline Node *newNode(size_t depth);
+	inline Block *newBlock(MemoryManager *memoryManager);
+	inline Block *newBlock() { return newBlock(this); }
+	inline Node *newNode(size_t depth, MemoryManager *memoryManager);
+	inline Node *newNode(size_t depth) { return newNode(depth, this); }
 	Node *&emptyNode(size_t depth);
-	void deleteNode(Node *node, size_t depth);
-	void runNode(Node *&p, Node *node, Node *up, Node *down, Node *left, Node *right, Node *upleft, Node *upright, Node *downleft, Node *downright, size_t depth);
-	virtual void run();
+	Node *copyNode(Node *node, size_t depth);
+	void deleteNode(Node *node, size_t depth, MemoryManager *memoryManager, size_t stopDepth);
+	void deleteNode(Node *node, size_t depth) { deleteNode(node, depth, this, 0); }
+	void retire(Node *node, size_t depth, bool single);
+	void deleteGarbage(const QVector<Garbage> &garbage);
+	void publish();
+	void runNode(Node *&p, Node *node, Node *up, Node *down, Node *left, Node *right, Node *upleft, Node *upright, Node *downleft, Node *downright, size_t depth, MemoryManager *memoryManager);
+	void runBlocks(Node *p, Node *node, Node *up, Node *down, Node *left, Node *right, Node *upleft, Node *upright, Node *downleft, Node *downright, MemoryManager *memoryManager);
+	void splitNode(Node *&p, Node *node, Node *up, Node *down, Node *left, Node *right, Node *upleft, Node *upright, Node *downleft, Node *downright, size_t depth);
+	void runTasks(int threadCount, bool deleting);
+	void workTasks(MemoryManager *memoryManager, bool deleting);
+	virtual void step();
 
 	volatile bool m_running;
+	RuleLife *m_rule;
 	QVector<Node *> m_emptyNode;
 	size_t m_depth;
 	Node *m_root;
-	QMutex *m_readLock, *m_writeLock;
+	QMutex *m_writeLock;
 
 	BigInteger m_x, m_y;
 	BigInteger m_generation;
+	// Retired since the last snapshot was published
+	QVector<Garbage> m_garbage;
+	// Made by the edit in progress, so in no snapshot yet
+	QSet<Node *> m_edited;
+
+	// Parallel step related
+	int m_threadCount;
+	QThreadPool *m_threadPool;
+	QVector<RunNodeTask> m_tasks;
+	QAtomicInt m_nextTask;
+	size_t m_taskDepth;
+	// Nodes above the tasks, children before parents
+	QVector<QPair<Node *, size_t> > m_splitNodes;
 
 	// Data Channel related
 	BigInteger mc_x, mc_y;
 	quint64 mc_w, mc_h;
+	BigInteger ms_x, ms_y;
+	quint64 ms_w, ms_h;
 };
 
 #endif
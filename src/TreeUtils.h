@@ -20,8 +20,15 @@
 #ifndef TREEUTILS_H
 #define TREEUTILS_H
 
+#include <algorithm>
+
+#include <QPair>
+#include <QVector>
+#include <QtAlgorithms>
+
 #include "BigInteger.h"
 #include "CanvasPainter.h"
+#include "DataChannel.h"
 #include "Utils.h"
 
 #define ul child[0]
@@ -35,6 +42,70 @@ inline void treePaintNode(CanvasPainter *painter, Node *node_ul, Node *node_ur,
 template <typename Block, typename Node>
 void treePaintNode(CanvasPainter *painter, Node *node, int x1, int y1, int x2, int y2, size_t depth, size_t scale, int offset_x, int offset_y);
 
+template <typename Algorithm, typename Block, typename Node>
+inline bool treeVisible(Algorithm *algorithm, Node *node, size_t depth)
+{
+	if (depth == Block::DEPTH)
+		return reinterpret_cast<Block *>(node)->visible(algorithm);
+	return node->visible(algorithm, depth);
+}
+
+/// Walks down from the 2x2 nodes of depth until they are of endDepth, keeping (x, y) in node_ul
+template <typename Node>
+inline void treeWalkDown(Node *&node_ul, Node *&node_ur, Node *&node_dl, Node *&node_dr, size_t &depth, size_t endDepth, const BigInteger &x, const BigInteger &y)
+{
+	while (depth > endDepth)
+	{
+		switch ((y.bit(depth - 1) << 1) | x.bit(depth - 1))
+		{
+		case 0:
+			//  ul ur  0  0
+			//  dl dr  0  0
+			//   0  0  0  0
+			//   0  0  0  0
+			node_ur = node_ul->ur;
+			node_dl = node_ul->dl;
+			node_dr = node_ul->dr;
+			node_ul = node_ul->ul;
+			break;
+
+		case 1:
+			//   0 ul ur  0
+			//   0 dl dr  0
+			//   0  0  0  0
+			//   0  0  0  0
+			node_dl = node_ul->dr;
+			node_ul = node_ul->ur;
+			node_dr = node_ur->dl;
+			node_ur = node_ur->ul;
+			break;
+
+		case 2:
+			//   0  0  0  0
+			//  ul ur  0  0
+			//  dl dr  0  0
+			//   0  0  0  0
+			node_ur = node_ul->dr;
+			node_ul = node_ul->dl;
+			node_dr = node_dl->ur;
+			node_dl = node_dl->ul;
+			break;
+
+		case 3:
+			//   0  0  0  0
+			//   0 ul ur  0
+			//   0 dl dr  0
+			//   0  0  0  0
+			node_ul = node_ul->dr;
+			node_ur = node_ur->dl;
+			node_dl = node_dl->ur;
+			node_dr = node_dr->ul;
+			break;
+		}
+		depth--;
+	}
+}
+
 /// Common paint() routine for binary tree based algorithms
 // Some magic in treePaint() to get rid of BigInteger manipulation:
 // We walk down and find 4 nodes cover the drawing area
@@ -87,56 +158,7 @@ inline void treePaint(Algorithm *algorithm, CanvasPainter *painter, const BigInt
 		// Step 1
 		size_t depth = m_depth - scale, endDepth = qMax<size_t>(qMax(bitlen(w), bitlen(h)), Block::DEPTH);
 		Node *node_ul = m_root, *node_ur = depth_emptyNode, *node_dl = depth_emptyNode, *node_dr = depth_emptyNode;
-		while (depth > endDepth)
-		{
-			switch ((y1.bit(depth - 1) << 1) | x1.bit(depth - 1))
-			{
-			case 0:
-				//  ul ur  0  0
-				//  dl dr  0  0
-				//   0  0  0  0
-				//   0  0  0  0
-				node_ur = node_ul->ur;
-				node_dl = node_ul->dl;
-				node_dr = node_ul->dr;
-				node_ul = node_ul->ul;
-				break;
-
-			case 1:
-				//   0 ul ur  0
-				//   0 dl dr  0
-				//   0  0  0  0
-				//   0  0  0  0
-				node_dl = node_ul->dr;
-				node_ul = node_ul->ur;
-				node_dr = node_ur->dl;
-				node_ur = node_ur->ul;
-				break;
-
-			case 2:
-				//   0  0  0  0
-				//  ul ur  0  0
-				//  dl dr  0  0
-				//   0  0  0  0
-				node_ur = node_ul->dr;
-				node_ul = node_ul->dl;
-				node_dr = node_dl->ur;
-				node_dl = node_dl->ul;
-				break;
-
-			case 3:
-				//   0  0  0  0
-				//   0 ul ur  0
-				//   0 dl dr  0
-				//   0  0  0  0
-				node_ul = node_ul->dr;
-				node_ur = node_ur->dl;
-				node_dl = node_dl->ur;
-				node_dr = node_dr->ul;
-				break;
-			}
-			depth--;
-		}
+		treeWalkDown(node_ul, node_ur, node_dl, node_dr, depth, endDepth, x1, y1);
 
 		// Step 2
 		int sx1 = x1.lowbits<int>(depth), sy1 = y1.lowbits<int>(depth);
@@ -161,36 +183,274 @@ inline void treePaintNode(Algorithm *algorithm, CanvasPainter *painter, Node *no
 template <typename Algorithm, typename Block, typename Node>
 void treePaintNode(Algorithm *algorithm, CanvasPainter *painter, Node *node, int x1, int y1, int x2, int y2, size_t depth, size_t scale, int offset_x, int offset_y)
 {
+	// The background is already filled
+	if (!treeVisible<Algorithm, Block, Node>(algorithm, node, depth + scale))
+		return;
 	if (depth + scale == Block::DEPTH)
 	{
 		Block *block = reinterpret_cast<Block *>(node);
-		if (depth == 0)
-			painter->drawGrid(offset_x + x1, offset_y + y1, block->visible(algorithm));
-		else
+		if (scale)
 		{
+			// Every grid stands for len x len cells of the block
+			int len = 1 << scale;
+			uint mask = (1u << len) - 1;
 			for (int x = x1; x <= x2; x++)
 				for (int y = y1; y <= y2; y++)
 				{
-					int state;
-					if (scale)
-					{
-						state = 0;
-						for (int i = x * (1 << scale); i < (x + 1) * (1 << scale); i++)
-							for (int j = y * (1 << scale); j < (y + 1) * (1 << scale); j++)
-								state |= block->get(i, j) > 0;
-					}
-					else
-						state = block->get(x, y);
-					painter->drawGrid(offset_x + x, offset_y + y, state);
+					int population = 0;
+					for (int j = y * len; j < (y + 1) * len; j++)
+						population += popCount((block->getRow(j) >> (x * len)) & mask);
+					painter->drawDensity(offset_x + x, offset_y + y, population, scale);
 				}
 		}
+		else
+		{
+			for (int x = x1; x <= x2; x++)
+				for (int y = y1; y <= y2; y++)
+					painter->drawGrid(offset_x + x, offset_y + y, block->get(x, y));
+		}
 	}
 	else if (depth == 0)
-		painter->drawGrid(offset_x + x1, offset_y + y1, node->visible(algorithm, depth + scale));
+		painter->drawDensity(offset_x + x1, offset_y + y1, node->population, scale);
 	else
 		treePaintNode<Algorithm, Block, Node>(algorithm, painter, node->ul, node->ur, node->dl, node->dr, x1, y1, x2, y2, depth - 1, scale, offset_x, offset_y);
 }
 
+// Rectangles sent are narrower and lower than 2^TREE_SEND_BITS cells, so
+// that the coordinates in the window of treeSend() fit in quint64s
+const size_t TREE_SEND_BITS = 62;
+
+/// Offset from the root of the first row (vertical) or column holding a visible cell, counted from the end if fromEnd
+// The nodes of a strip along the edge are walked down, keeping the children
+// on the side of the edge unless none of them is visible.
+template <typename Algorithm, typename Block, typename Node>
+BigInteger treeEdge(Algorithm *algorithm, Node *m_root, size_t m_depth, bool vertical, bool fromEnd)
+{
+	// Children of the upper (left) and the lower (right) half
+	const int halves[2][2] = {{0, vertical? 1: 2}, {vertical? 2: 1, 3}};
+	QVector<Node *> strip, next;
+	strip.append(m_root);
+	BigInteger ret;
+	for (size_t depth = m_depth; depth > Block::DEPTH; depth--)
+	{
+		int half = fromEnd? 1: 0;
+		for (int pass = 0; pass < 2; pass++)
+		{
+			for (int i = 0; i < strip.size(); i++)
+				for (int k = 0; k < 2; k++)
+				{
+					Node *child = strip[i]->child[halves[half][k]];
+					if (treeVisible<Algorithm, Block, Node>(algorithm, child, depth - 1))
+						next.append(child);
+				}
+			if (!next.isEmpty())
+				break;
+			half ^= 1;
+		}
+		if (half)
+			ret.setBit(depth - 1);
+		// Shared nodes are walked once
+		qSort(next);
+		next.erase(std::unique(next.begin(), next.end()), next.end());
+		qSwap(strip, next);
+		next.clear();
+	}
+	// Rows or columns of the blocks holding a visible cell
+	uint mask = 0;
+	for (int i = 0; i < strip.size(); i++)
+		for (size_t y = 0; y < Block::SIZE; y++)
+		{
+			uint row = reinterpret_cast<Block *>(strip[i])->getRow(y);
+			if (!vertical)
+				mask |= row;
+			else if (row)
+				mask |= 1u << y;
+		}
+	return ret + (fromEnd? bitlen(mask) - 1: bitlen(mask & (~mask + 1)) - 1);
+}
+
+/// Common boundingRect() routine for binary tree based algorithms
+template <typename Algorithm, typename Block, typename Node>
+bool treeBoundingRect(Algorithm *algorithm, BigInteger *x, BigInteger *y, quint64 *w, quint64 *h, const BigInteger &m_x, const BigInteger &m_y, size_t m_depth, Node *m_root)
+{
+	if (!treeVisible<Algorithm, Block, Node>(algorithm, m_root, m_depth))
+	{
+		*x = 0;
+		*y = 0;
+		*w = *h = 0;
+		return true;
+	}
+	BigInteger x1 = treeEdge<Algorithm, Block, Node>(algorithm, m_root, m_depth, false, false);
+	BigInteger y1 = treeEdge<Algorithm, Block, Node>(algorithm, m_root, m_depth, true, false);
+	BigInteger width = treeEdge<Algorithm, Block, Node>(algorithm, m_root, m_depth, false, true) - x1 + 1;
+	BigInteger height = treeEdge<Algorithm, Block, Node>(algorithm, m_root, m_depth, true, true) - y1 + 1;
+	if (width.bitCount() > TREE_SEND_BITS || height.bitCount() > TREE_SEND_BITS)
+		return false;
+	*x = m_x + x1;
+	*y = m_y + y1;
+	*w = width.lowbits<quint64>(64);
+	*h = height.lowbits<quint64>(64);
+	return true;
+}
+
+/// Sends the rows of the window part [x1, x2] x [y1, y2] as the rectangle part starting at (offset_x, offset_y)
+// The rows must come in order, and the cells of a row from left to right.
+// Dead cells after the last live one of a row and empty rows after the
+// last live row are left out.
+class TreeSender
+{
+public:
+	TreeSender(DataChannel *channel, quint64 x1, quint64 y1, quint64 x2, quint64 y2, quint64 offset_x, quint64 offset_y)
+		: m_channel(channel), m_x1(x1), m_y1(y1), m_x2(x2), m_y2(y2), m_offset_x(offset_x), m_offset_y(offset_y), m_row(0), m_column(0)
+	{
+	}
+
+	/// Whether part of the square of len at (x, y) is to be sent
+	inline bool overlaps(quint64 x, quint64 y, quint64 len) const
+	{
+		return x <= m_x2 && x + len > m_x1 && y <= m_y2 && y + len > m_y1;
+	}
+
+	/// Sends the row of a block at (x, y), bit i being the cell at (x + i, y)
+	inline void sendRow(quint64 x, quint64 y, uint bits)
+	{
+		if (y < m_y1 || y > m_y2)
+			return;
+		if (x < m_x1)
+			bits &= ~0u << (m_x1 - x);
+		if (m_x2 - x < 8)
+			bits &= (2u << (m_x2 - x)) - 1;
+		if (!bits)
+			return;
+		quint64 row = y - m_y1 + m_offset_y;
+		if (row != m_row)
+		{
+			m_channel->send(DATACHANNEL_EOLN, row - m_row);
+			m_row = row;
+			m_column = 0;
+		}
+		// Wraps around for the cells left of m_x1, which are masked out
+		quint64 column = x - m_x1 + m_offset_x;
+		for (; bits; bits >>= 1, column++)
+			if (bits & 1)
+			{
+				if (column > m_column)
+					m_channel->send(0, column - m_column);
+				m_channel->send(1, 1);
+				m_column = column + 1;
+			}
+	}
+
+	inline void finish()
+	{
+		m_channel->send(DATACHANNEL_EOF, 1);
+	}
+
+private:
+	DataChannel *m_channel;
+	quint64 m_x1, m_y1, m_x2, m_y2;
+	quint64 m_offset_x, m_offset_y;
+	// Where the next cell would be sent
+	quint64 m_row, m_column;
+};
+
+template <typename Algorithm, typename Block, typename Node>
+inline void treeSendAppend(Algorithm *algorithm, TreeSender &sender, QVector<QPair<quint64, Node *> > &strip, Node *node, quint64 x, quint64 y, size_t depth)
+{
+	if (treeVisible<Algorithm, Block, Node>(algorithm, node, depth) && sender.overlaps(x, y, Q_UINT64_C(1) << depth))
+		strip.append(qMakePair(x, node));
+}
+
+/// Sends the rows of a strip of nodes at (x, y) of the same y, from left to right
+template <typename Algorithm, typename Block, typename Node>
+void treeSendStrip(Algorithm *algorithm, TreeSender &sender, const QVector<QPair<quint64, Node *> > &strip, quint64 y, size_t depth)
+{
+	if (depth == Block::DEPTH)
+	{
+		for (size_t i = 0; i < Block::SIZE; i++)
+			for (int j = 0; j < strip.size(); j++)
+				sender.sendRow(strip[j].first, y + i, reinterpret_cast<Block *>(strip[j].second)->getRow(i));
+		return;
+	}
+	quint64 len = Q_UINT64_C(1) << (depth - 1);
+	QVector<QPair<quint64, Node *> > upper, lower;
+	for (int i = 0; i < strip.size(); i++)
+	{
+		quint64 x = strip[i].first;
+		Node *node = strip[i].second;
+		treeSendAppend<Algorithm, Block, Node>(algorithm, sender, upper, node->ul, x, y, depth - 1);
+		treeSendAppend<Algorithm, Block, Node>(algorithm, sender, upper, node->ur, x + len, y, depth - 1);
+		treeSendAppend<Algorithm, Block, Node>(algorithm, sender, lower, node->dl, x, y + len, depth - 1);
+		treeSendAppend<Algorithm, Block, Node>(algorithm, sender, lower, node->dr, x + len, y + len, depth - 1);
+	}
+	if (!upper.isEmpty())
+		treeSendStrip<Algorithm, Block, Node>(algorithm, sender, upper, y, depth - 1);
+	if (!lower.isEmpty())
+		treeSendStrip<Algorithm, Block, Node>(algorithm, sender, lower, y + len, depth - 1);
+}
+
+/// Common send() routine for binary tree based algorithms
+// The rectangle is clipped to the universe and the 4 nodes covering it are
+// found as in treePaint(). The rows are then sent a strip of nodes at a
+// time: a strip is split into the strips of the upper and of the lower
+// children, leaving out the invisible ones, so the time taken is bound by
+// the number of visible nodes rather than the area of the rectangle.
+template <typename Algorithm, typename Block, typename Node>
+void treeSend(Algorithm *algorithm, DataChannel *channel, const BigInteger &x, const BigInteger &y, quint64 w, quint64 h, const BigInteger &m_x, const BigInteger &m_y, size_t m_depth, Node *m_root, Node *depth_emptyNode)
+{
+	BigInteger len = BigInteger::exp2(m_depth);
+	BigInteger x1 = x - m_x, y1 = y - m_y, x2 = x1 + BigInteger(w) - 1, y2 = y1 + BigInteger(h) - 1;
+
+	// Out of range
+	if (w == 0 || h == 0 || x2.sgn() < 0 || x1 >= len || y2.sgn() < 0 || y1 >= len)
+	{
+		channel->send(DATACHANNEL_EOF, 1);
+		return;
+	}
+
+	// The coordinate of the upper left cell in the rectangle
+	quint64 offset_x = 0, offset_y = 0;
+	if (x1.sgn() < 0)
+	{
+		offset_x = (BigInteger(0) - x1).lowbits<quint64>(64);
+		x1 = 0;
+	}
+	if (y1.sgn() < 0)
+	{
+		offset_y = (BigInteger(0) - y1).lowbits<quint64>(64);
+		y1 = 0;
+	}
+	if (x2 >= len)
+		x2 = len - 1;
+	if (y2 >= len)
+		y2 = len - 1;
+
+	BigInteger sw = x2 - x1 + 1, sh = y2 - y1 + 1;
+	size_t depth = m_depth, endDepth = qMax<size_t>(qMax(sw.bitCount(), sh.bitCount()), Block::DEPTH);
+	if (endDepth > TREE_SEND_BITS)
+	{
+		qWarning("treeSend(): the rectangle is too large.");
+		channel->send(DATACHANNEL_EOF, 1);
+		return;
+	}
+	Node *node_ul = m_root, *node_ur = depth_emptyNode, *node_dl = depth_emptyNode, *node_dr = depth_emptyNode;
+	treeWalkDown(node_ul, node_ur, node_dl, node_dr, depth, endDepth, x1, y1);
+
+	quint64 sx1 = x1.lowbits<quint64>(depth), sy1 = y1.lowbits<quint64>(depth);
+	TreeSender sender(channel, sx1, sy1, sx1 + sw.lowbits<quint64>(64) - 1, sy1 + sh.lowbits<quint64>(64) - 1, offset_x, offset_y);
+	quint64 size = Q_UINT64_C(1) << depth;
+	QVector<QPair<quint64, Node *> > upper, lower;
+	treeSendAppend<Algorithm, Block, Node>(algorithm, sender, upper, node_ul, 0, 0, depth);
+	treeSendAppend<Algorithm, Block, Node>(algorithm, sender, upper, node_ur, size, 0, depth);
+	treeSendAppend<Algorithm, Block, Node>(algorithm, sender, lower, node_dl, 0, size, depth);
+	treeSendAppend<Algorithm, Block, Node>(algorithm, sender, lower, node_dr, size, size, depth);
+	if (!upper.isEmpty())
+		treeSendStrip<Algorithm, Block, Node>(algorithm, sender, upper, 0, depth);
+	if (!lower.isEmpty())
+		treeSendStrip<Algorithm, Block, Node>(algorithm, sender, lower, size, depth);
+	sender.finish();
+}
+
 #undef ul
 #undef ur
 #undef dl
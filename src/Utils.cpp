@@ -26,3 +26,11 @@ int bitlen(int num)
 		num >>= 1;
 	return ret;
 }
+
+int popCount(quint64 num)
+{
+	num = num - ((num >> 1) & Q_UINT64_C(0x5555555555555555));
+	num = (num & Q_UINT64_C(0x3333333333333333)) + ((num >> 2) & Q_UINT64_C(0x3333333333333333));
+	num = (num + (num >> 4)) & Q_UINT64_C(0x0F0F0F0F0F0F0F0F);
+	return (num * Q_UINT64_C(0x0101010101010101)) >> 56;
+}
@@ -20,13 +20,22 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <QtGlobal>
+
 // Bit manipulation utils
 #define BIT(b, type) (static_cast<type>(1) << static_cast<type>(b))
 #define TEST_BIT(x, b) ((x) & BIT(b, decltype(void(), x)))
 #define SET_BIT(x, b) ((x) |= BIT(b, decltype(void(), x)))
 #define CLR_BIT(x, b) ((x) &= ~BIT(b, decltype(void(), x)))
 
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
 extern int bitlen(int num);
+extern int popCount(quint64 num);
 
 // Factory manipulation utils
 #define ABSTRACT_FACTORY(baseClassName) \
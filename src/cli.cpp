@@ -0,0 +1,212 @@
+/*
+ *   Copyright (C) 2011 by Xiangyan Sun <wishstudio@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation; either version 3, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details
+ *
+ *   You should have received a copy of the GNU General Public
+ *   License along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <cstdio>
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QTextStream>
+#include <QTime>
+
+#include "AbstractAlgorithm.h"
+#include "AbstractFileFormat.h"
+#include "AlgorithmManager.h"
+#include "BigInteger.h"
+#include "FileFormatManager.h"
+#include "HashLife.h"
+#include "RuleLife.h"
+#include "TreeLife.h"
+
+static void usage(QTextStream &err)
+{
+	err << "Usage: klife-cli [options] input [output]\n"
+		<< "Runs the pattern in input, then writes it to output if given\n\n"
+		<< "  -a, --algorithm NAME      hashlife (default) or treelife\n"
+		<< "  -r, --rule RULE           B3/S23 or 23/3, instead of the rule of input\n"
+		<< "  -g, --generations N       generations to advance, 0 by default\n"
+		<< "  -e, --step-exponent E     advance at most 2^E generations a step\n"
+		<< "  -t, --threads N           worker threads of the algorithm\n";
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	QTextStream out(stdout), err(stderr);
+
+	QStringList args = app.arguments();
+	QString algorithmName = "hashlife", ruleString, input, output;
+	quint64 generations = 0;
+	int maxExponent = 63, threads = 0;
+	for (int i = 1; i < args.size(); i++)
+	{
+		QString arg = args[i];
+		if (arg == "-h" || arg == "--help")
+		{
+			usage(out);
+			return 0;
+		}
+		if (!arg.startsWith("-"))
+		{
+			if (input.isEmpty())
+				input = arg;
+			else if (output.isEmpty())
+				output = arg;
+			else
+			{
+				usage(err);
+				return 1;
+			}
+			continue;
+		}
+		if (i + 1 == args.size())
+		{
+			err << "Missing value of " << arg << "\n";
+			return 1;
+		}
+		QString value = args[++i];
+		bool ok = true;
+		if (arg == "-a" || arg == "--algorithm")
+			algorithmName = value.toLower();
+		else if (arg == "-r" || arg == "--rule")
+			ruleString = value;
+		else if (arg == "-g" || arg == "--generations")
+			generations = value.toULongLong(&ok);
+		else if (arg == "-e" || arg == "--step-exponent")
+		{
+			maxExponent = value.toInt(&ok);
+			ok = ok && maxExponent >= 0 && maxExponent < 64;
+		}
+		else if (arg == "-t" || arg == "--threads")
+		{
+			threads = value.toInt(&ok);
+			ok = ok && threads > 0;
+		}
+		else
+		{
+			err << "Unknown option " << arg << "\n";
+			return 1;
+		}
+		if (!ok)
+		{
+			err << "Invalid value " << value << " of " << arg << "\n";
+			return 1;
+		}
+	}
+	if (input.isEmpty())
+	{
+		usage(err);
+		return 1;
+	}
+
+	AbstractAlgorithm *algorithm;
+	if (algorithmName == "hashlife")
+		algorithm = new HashLife();
+	else if (algorithmName == "treelife")
+		algorithm = new TreeLife();
+	else
+	{
+		err << "Unknown algorithm " << algorithmName << "\n";
+		return 1;
+	}
+	// Rather than failing to load, or to save after the whole run
+	foreach (const QString &fileName, QStringList() << input << output)
+	{
+		if (fileName.isEmpty())
+			continue;
+		AbstractFileFormat *format = FileFormatManager::fileFormat(fileName);
+		if (!format)
+		{
+			err << "Unknown file format of " << fileName << "\n";
+			return 1;
+		}
+		if (!format->acceptAlgorithm(algorithm))
+		{
+			err << format->formatName() << " files are not supported by " << algorithm->name() << "\n";
+			return 1;
+		}
+	}
+	RuleLife *rule = NULL;
+	if (!ruleString.isEmpty() && !(rule = RuleLife::fromString(ruleString)))
+	{
+		err << "Invalid rule " << ruleString << "\n";
+		return 1;
+	}
+	AlgorithmManager::setAlgorithm(algorithm);
+	AlgorithmManager::setRule(new RuleLife("3", "23"));
+	algorithm->setInfinity(true, true);
+	algorithm->setHyperspeed(false);
+	if (threads)
+		algorithm->setThreadCount(threads);
+
+	QTime timer;
+	timer.start();
+	if (!FileFormatManager::readFile(input))
+	{
+		err << "Cannot read " << input << "\n";
+		return 1;
+	}
+	// Whatever rule the file asked for is overridden
+	if (rule)
+		AlgorithmManager::setRule(rule);
+	int loadTime = timer.restart();
+
+	// Steps of 2^exponent generations as long as they fit, then smaller ones for
+	// the rest, so the memoized results of a step size serve many steps
+	BigInteger start = algorithm->generation();
+	quint64 remaining = generations, steps = 0;
+	int exponent = qMin(maxExponent, 63);
+	while (remaining)
+	{
+		while (!(remaining >> exponent))
+			exponent--;
+		if (static_cast<int>(algorithm->stepExponent()) != exponent)
+		{
+			algorithm->setStepExponent(exponent);
+			// Algorithms without a step size advance a generation a step
+			if (static_cast<int>(algorithm->stepExponent()) != exponent)
+				exponent = 0;
+		}
+		algorithm->runStep();
+		algorithm->wait();
+		QCoreApplication::processEvents();
+		remaining -= Q_UINT64_C(1) << exponent;
+		steps++;
+	}
+	int runTime = timer.restart();
+
+	if (!output.isEmpty() && !FileFormatManager::writeFile(output))
+	{
+		err << "Cannot write " << output << "\n";
+		return 1;
+	}
+	int saveTime = timer.elapsed();
+
+	out << "algorithm: " << algorithm->name() << "\n"
+		<< "rule: " << AlgorithmManager::rule()->string() << "\n"
+		<< "generation: " << QString(algorithm->generation()) << "\n"
+		<< "advanced: " << QString(algorithm->generation() - start) << "\n"
+		<< "population: " << QString(algorithm->population()) << "\n"
+		<< "steps: " << steps << "\n"
+		<< "load ms: " << loadTime << "\n"
+		<< "run ms: " << runTime << "\n"
+		<< "save ms: " << saveTime << "\n";
+	if (runTime)
+		out << "generations/s: " << generations * 1000.0 / runTime << "\n";
+	return 0;
+}